@@ -0,0 +1,94 @@
+#!/usr/bin/env python3
+"""Turns a heap dump of memory.so (see memory_dump in memory.h) into an
+occupancy map.
+
+    python3 heapmap.py dump.json           # map on the terminal
+    python3 heapmap.py dump.json -o map.svg
+
+A file written through MEMORY_DUMP may hold several dumps; the last one
+is shown unless --index is given.
+"""
+
+import argparse
+import json
+import sys
+
+SHADES = " .:-=+*#%@"  # occupancy 0 to 9
+CELL = 8  # pixels per cell in the SVG
+
+
+def load(path, index):
+    dumps = []
+    decoder = json.JSONDecoder()
+    text = open(path).read()
+    pos = 0
+    while True:
+        while pos < len(text) and text[pos].isspace():
+            pos += 1
+        if pos == len(text):
+            break
+        dump, pos = decoder.raw_decode(text, pos)
+        dumps.append(dump)
+    if not dumps:
+        sys.exit("%s: no dump found" % path)
+    return dumps[index]
+
+
+def size(n):
+    for unit in ("B", "K", "M", "G"):
+        if n < 1024 or unit == "G":
+            return "%d%s" % (n, unit) if unit == "B" else "%.1f%s" % (n, unit)
+        n /= 1024.0
+
+
+def text_map(dump):
+    print("mapped %s, purged %s, free %s in %d blocks, largest free %s, "
+          "fragmentation %.1f%%" % (
+              size(dump["mapped_bytes"]), size(dump["purged_bytes"]),
+              size(dump["free_bytes"]), dump["free_blocks"],
+              size(dump["largest_free"]), dump["fragmentation"] / 10.0))
+    for chunk in dump["chunks"]:
+        cells = "".join(SHADES[int(c)] for c in chunk["map"])
+        print("%18s %8s |%s| %3d%% used, %d free blocks, largest %s" % (
+            chunk["addr"], size(chunk["size"]), cells,
+            100 * chunk["used_bytes"] // max(chunk["size"], 1),
+            chunk["free_blocks"], size(chunk["largest_free"])))
+    print("free blocks by size:")
+    for bucket in dump["histogram"]:
+        print("  >= %8s: %8d blocks, %10s" % (
+            size(bucket["min"]), bucket["count"], size(bucket["bytes"])))
+
+
+def svg_map(dump, out):
+    chunks = dump["chunks"]
+    width = len(chunks[0]["map"]) * CELL if chunks else 0
+    out.write('<svg xmlns="http://www.w3.org/2000/svg" width="%d" height="%d">\n'
+              % (width + 200, len(chunks) * (CELL + 2)))
+    for row, chunk in enumerate(chunks):
+        y = row * (CELL + 2)
+        for col, c in enumerate(chunk["map"]):
+            level = 255 - int(c) * 25
+            out.write('<rect x="%d" y="%d" width="%d" height="%d" fill="rgb(255,%d,%d)"/>\n'
+                      % (col * CELL, y, CELL, CELL, level, level))
+        out.write('<text x="%d" y="%d" font-size="%d">%s %s</text>\n'
+                  % (width + 4, y + CELL, CELL, chunk["addr"], size(chunk["size"])))
+    out.write("</svg>\n")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("dump")
+    parser.add_argument("-o", "--output", help="write an SVG image to this file")
+    parser.add_argument("-i", "--index", type=int, default=-1,
+                        help="which dump of the file to show (default: the last)")
+    args = parser.parse_args()
+    dump = load(args.dump, args.index)
+    if args.output:
+        with open(args.output, "w") as out:
+            svg_map(dump, out)
+    else:
+        text_map(dump)
+
+
+if __name__ == "__main__":
+    main()
@@ -153,80 +153,415 @@ static int __try_size_t_multiply(size_t *c, size_t a, size_t b) {
 */
 
 #define MMAP_MIN_SIZE	((size_t) 16777216) // 16 MB
+#define LARGE_MIN_SIZE	((size_t) 4194304) // 4 MB
+#define HUGE_PAGE_SIZE	((size_t) 2097152) // 2 MB
+#define PAGE_SIZE	((size_t) 4096)
+#define ALIGNMENT	((size_t) 16) // alignment of every block and payload
+
+#define ALIGN_UP(x, a)	(((x) + ((a) - ((size_t) 1))) & ~((a) - ((size_t) 1)))
 
 typedef struct struct_block_t{
 	void *addr;
 	size_t length;
 	size_t mmap_size;
 	struct struct_block_t *next;
+    struct struct_block_t *prev;
+    struct struct_block_t *left; // free tree, only valid while free
+    struct struct_block_t *right;
     int free;
-} block_t; 
+    int source; // chunk source the block of memory came from
+} __attribute__((aligned(16))) block_t; 
 
 #define MEM_SIZE	(sizeof(block_t))
+#define MIN_BLOCK	(MEM_SIZE + ALIGNMENT) // smallest block worth splitting off
+#define CACHELINE	((size_t) 64) // MEM_SIZE, so a header fills one line
 
 static block_t *head;
 
+/* Runtime configuration, see __configure_impl. Blocks of memory are
+   mapped chunk_size bytes at a time; requests of large_threshold
+   bytes or more get a mapping of their own, which is unmapped as soon
+   as they are freed. */
+static size_t chunk_size = MMAP_MIN_SIZE;
+static size_t large_threshold = LARGE_MIN_SIZE;
+
+/* Huge page backing of the mappings of at least HUGE_PAGE_SIZE bytes.
+   THP_ON aligns them to the huge page size and asks for transparent
+   huge pages; THP_HUGETLB first tries to get them from hugetlbfs and
+   falls back to THP_ON when no huge pages are reserved. */
+enum thp_mode {
+    THP_OFF,
+    THP_ON,
+    THP_HUGETLB
+};
+
+static enum thp_mode thp_mode = THP_OFF;
+
+/* Chunk sources. Source 0 maps chunks with mmap and unmaps them with
+   munmap. An embedding application can register other sources that
+   hand out and take back chunks (e.g. from a file on a tmpfs or
+   hugetlbfs mount); new chunks come from the current source. Every
+   chunk remembers its source, so it goes back to the source it came
+   from even after the current source was changed. The hooks are
+   called with the memory management lock held and must not allocate
+   through malloc. A source that maps in larger units than pages says
+   so, and gets lengths rounded up to them, so that the heap uses (and
+   counts against the soft limit) all the memory the source maps. */
+#define MAX_SOURCES	8
+
+typedef struct struct_source_t{
+    void *(*alloc)(size_t, void *);
+    int (*dalloc)(void *, size_t, void *);
+    void *arg;
+    size_t unit; // a multiple of PAGE_SIZE
+} source_t;
+
+static source_t sources[MAX_SOURCES];
+static int source_count = 1;
+static int current_source;
+
+/* Prefaulting. With populate set, every new mapping is faulted in 
+   right away (MAP_POPULATE), so the first writes into a fresh chunk
+   do not take page faults in the middle of a request. The reserve is
+   one chunk of that many bytes mapped and prefaulted at startup; it
+   is never unmapped, so it stays warm. */
+static int populate;
+static size_t reserve_size;
+static void *reserve_addr;
+
+/* Soft limit on the memory of the heap, 0 for none. The heap uses
+   mapped_bytes of mapped memory, of which purged_bytes were given back
+   with MADV_DONTNEED (see __purge_impl); a new mapping that would push
+   the difference over heap_limit first purges free memory, then calls
+   pressure_hook so that the application frees some of its memory. 
+   Only if that does not help either does the mapping fail. The hook
+   (__memory_pressure in memory.c) releases the memory management lock
+   while the application's callback runs. in_pressure makes sure that
+   only one callback runs at a time: mappings over the limit in other
+   threads fail meanwhile instead of waiting, as do those of the
+   callback itself, which could not wait for its own return. */
+static size_t heap_limit;
+static size_t mapped_bytes;
+static size_t purged_bytes;
+static void (*pressure_hook)(size_t);
+static int in_pressure;
+
+/* Empties the per-CPU caches of memory.c into the heap before a purge,
+   so that the pages of the blocks they hold can be released too. */
+static void (*cache_flush_hook)(void);
+
+/* Cache line placement. A block for more than CACHELINE - ALIGNMENT
+   bytes starts on a cache line and its length is rounded up to whole
+   lines, so that its header fills the line before the payload and the
+   payload has its lines to itself: two such objects never share a
+   line, whichever threads use them. get_block aligns such blocks by
+   giving the few bytes in front of them to the previous block. */
+static int cacheline_mode = 1;
+
+/* Whether memory.c may keep small blocks in its per-CPU caches, see
+   __block_class_impl, and how many bytes of blocks it may let them 
+   hold in total. */
+static int cache_enabled = 1;
+static size_t cache_budget = 8388608; // 8 MB
+static size_t cache_decay = 256; // refills and flushes between decay passes
+
+/* Deferred coalescing. With defer_mode set, a freed block that is
+   short enough is not merged with its neighbours right away but goes
+   onto the quick list of its size class, from which __malloc_impl 
+   takes it again for a request of that class; for the heap, it stays
+   allocated. Workloads that free and allocate the same sizes hence
+   skip the merge and the split. The quick lists are merged into the
+   heap in one pass when get_block finds no fitting free block, when 
+   they hold more than QUICK_MAX_BYTES and before a purge. Like the
+   remote frees, the blocks are linked through their payload. */
+#define QUICK_CLASSES	64 // blocks for requests up to 1 KB
+#define QUICK_MAX_BYTES	((size_t) 4194304) // 4 MB
+
+static int defer_mode;
+static block_t *quick[QUICK_CLASSES];
+static size_t quick_bytes;
+
+/* All free blocks are also kept in a treap ordered by (length, address),
+   so get_block finds the best fit in O(log n) instead of walking the
+   address ordered list. Taking the smallest address among equal lengths
+   keeps allocations packed towards the start of the chunks. The treap
+   priority is a hash of the block address, so it needs no extra field. */
+static block_t *free_tree;
+
+/* Blocks whose free() could not get the memory management lock.
+   Producers push with a CAS, the next malloc (which holds the lock)
+   takes the whole list with one exchange, so there is no ABA problem.
+   The link is stored in the first bytes of the dead payload. */
+static block_t *remote_frees;
+
+/* A region hands out memory by bumping a pointer through blocks it
+   takes from the heap; all of them are given back at once when the
+   region is destroyed. The blocks are linked through the first
+   ALIGNMENT bytes of their payload. Each block is twice as large as
+   the previous one, up to REGION_MAX_SIZE. */
+#define REGION_MIN_SIZE	((size_t) 65536) // 64 KB
+#define REGION_MAX_SIZE	((size_t) 4194304) // 4 MB
+
+typedef struct region{
+    block_t *blocks;
+    void *cur;
+    void *end;
+    size_t next_size;
+} region_t;
+
+/* Blocks of memory a forked child inherited from its parent while in
+   copy-on-write mode, sorted by address. The child never writes a
+   header in them, neither to allocate nor to free, so their pages
+   stay shared with the parent. The table is a mapping of its own for
+   the same reason. */
+typedef struct struct_range_t{
+    void *addr;
+    size_t length;
+} range_t;
+
+static range_t *inherited;
+static size_t inherited_count;
+static size_t inherited_map_size;
+
+static inline unsigned long long tree_priority(block_t *ptr){
+    unsigned long long x = (unsigned long long) ((size_t) ptr);
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    return x;
+}
+
+static inline int tree_less(block_t *a, block_t *b){
+    if (a->length != b->length)
+        return a->length < b->length;
+    return ((void *) a) < ((void *) b);
+}
+
+static block_t *tree_merge(block_t *a, block_t *b){
+    /*
+     * merge two treaps where every key in a is smaller than every key in b
+     */
+    if (a == NULL) return b;
+    if (b == NULL) return a;
+    if (tree_priority(a) > tree_priority(b)){
+        a->right = tree_merge(a->right, b);
+        return a;
+    }
+    b->left = tree_merge(a, b->left);
+    return b;
+}
+
+static void tree_split(block_t *t, block_t *key, block_t **l, block_t **r){
+    /*
+     * split treap t into keys smaller than key (l) and the rest (r)
+     */
+    if (t == NULL){
+        *l = NULL;
+        *r = NULL;
+    }
+    else if (tree_less(t, key)){
+        *l = t;
+        tree_split(t->right, key, &t->right, r);
+    }
+    else {
+        *r = t;
+        tree_split(t->left, key, l, &t->left);
+    }
+}
+
+void tree_insert(block_t *ptr){
+    block_t **link = &free_tree;
+    unsigned long long prio = tree_priority(ptr);
+
+    while (*link != NULL && tree_priority(*link) > prio)
+        link = tree_less(ptr, *link) ? &(*link)->left : &(*link)->right;
+
+    tree_split(*link, ptr, &ptr->left, &ptr->right);
+    *link = ptr;
+}
+
+void tree_remove(block_t *ptr){
+    block_t **link = &free_tree;
+
+    while (*link != ptr){
+        if (*link == NULL) return; // not in the tree
+        link = tree_less(ptr, *link) ? &(*link)->left : &(*link)->right;
+    }
+    *link = tree_merge(ptr->left, ptr->right);
+    ptr->left = NULL;
+    ptr->right = NULL;
+}
+
+block_t *tree_best_fit(size_t size){
+    /*
+     * smallest free block with length >= size, lowest address first
+     */
+    block_t *cur, *best;
+    best = NULL;
+    cur = free_tree;
+    while (cur != NULL){
+        if (cur->length >= size){
+            best = cur;
+            cur = cur->left;
+        }
+        else
+            cur = cur->right;
+    }
+    return best;
+}
+
+int block_inherited(block_t *ptr){
+    /*
+     * binary search for the block of memory of ptr among the inherited ones
+     */
+    size_t lo, hi, mid;
+    lo = 0;
+    hi = inherited_count;
+    while (lo < hi){
+        mid = lo + (hi - lo) / 2;
+        if (inherited[mid].addr == ptr->addr)
+            return 1;
+        if (inherited[mid].addr < ptr->addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return 0;
+}
+
+int unmap_block(block_t *ptr){
+    /*
+     * give the block of memory of ptr back to its source, 0 on success
+     */
+    if (ptr->source == 0)
+        return munmap(ptr->addr, ptr->mmap_size);
+    return sources[ptr->source].dalloc(ptr->addr, ptr->mmap_size, 
+                                       sources[ptr->source].arg);
+}
+
+size_t block_interior(block_t *ptr, void **start){
+    /*
+     * the whole pages inside the block ptr, behind its header: stores the 
+     * first in start and returns their length
+     */
+    void *end;
+
+    *start = (void *) ALIGN_UP((size_t) (((void *) ptr) + MEM_SIZE), PAGE_SIZE);
+    end = (void *) (((size_t) (((void *) ptr) + ptr->length)) & ~(PAGE_SIZE - 1));
+    if (end <= *start)
+        return 0;
+    return end - *start;
+}
+
+void unpurge_block(block_t *ptr){
+    /*
+     * the pages of the purged free block ptr are going to be used again
+     */
+    void *start;
+
+    if (ptr->free != 2)
+        return;
+    purged_bytes -= block_interior(ptr, &start);
+    ptr->free = 1;
+}
+
+int release_chunk(block_t *ptr){
+    /*
+     * unmap the free block ptr, which spans its whole block of memory, and 
+     * take it off the list. 0 on success
+     */
+    block_t *prev, *next;
+    size_t length;
+
+    // ptr lives inside the mapping, so read its neighbours first
+    prev = ptr->prev;
+    next = ptr->next;
+    length = ptr->mmap_size;
+    if (unmap_block(ptr) != 0)
+        return -1;
+    mapped_bytes -= length;
+    if (prev == NULL)
+        head = next;
+    else
+        prev->next = next;
+    if (next != NULL)
+        next->prev = prev;
+    return 0;
+}
+
 void remove_block(block_t *ptr){
     /*
      * This function takes in a pointer (ptr) to a block and either
      * 1.) merges with the left or right pointers 
      * 2.) becomes unmapped
+     * a block that stays mapped goes (back) into the free tree
      */
-    block_t *prev_prev, *prev, *cur;
-    prev_prev = NULL; // previous node of the previous node
-    prev = NULL; 
-    cur = head;
+    block_t *prev, *next;
+
+    // inherited memory is left alone, see inherit_blocks
+    if (inherited_count != 0 && block_inherited(ptr))
+        return;
 
-    while (cur != ptr){
-        prev_prev = prev;
-        prev = cur;
-        cur = cur->next;
-        if (cur == NULL)
-            return;
-    }
     // merge with the next pointer of ptr if it is free and in the same block of
     // memory as ptr
-    if (ptr->next != NULL && ptr->next->free && ptr->addr == ptr->next->addr){
-        ptr->length += ptr->next->length;
-        ptr->next = ptr->next->next;
+    next = ptr->next;
+    if (next != NULL && next->free && ptr->addr == next->addr){
+        tree_remove(next);
+        unpurge_block(next);
+        ptr->length += next->length;
+        ptr->next = next->next;
+        if (ptr->next != NULL)
+            ptr->next->prev = ptr;
     }
     // merge with with the previous pointer if it meets the same criteria as above
+    prev = ptr->prev;
     if (prev != NULL && prev->free && ptr->addr == prev->addr) {
-        size_t length = ptr->length;
-        block_t *next = ptr->next;
+        tree_remove(prev);
+        unpurge_block(prev);
+        prev->length += ptr->length;
+        prev->next = ptr->next;
+        if (prev->next != NULL)
+            prev->next->prev = prev;
         ptr = prev;
-        ptr->length += length;
-        ptr->next = next;
     }
 
     ptr->free = 1;
-    if (ptr->length != ptr->mmap_size) // not all memory in current block is free
+    // not all memory in current block is free, or it is the last of several
+    // chunks, which is kept mapped for the next allocations
+    if (ptr->length != ptr->mmap_size || 
+        (ptr->next == NULL && ptr->prev != NULL && ptr->mmap_size == chunk_size) ||
+        ptr->addr == reserve_addr){
+        tree_insert(ptr);
         return;
-    
-    // all memory in current block is free, so unmap 
-    if (ptr == head){
-        if (ptr->next == NULL){
-            if (munmap(ptr->addr, ptr->mmap_size) == 0){
-                head = NULL;
-            }
-        }
-        else if (ptr->next->addr != ptr->addr){
-            block_t *next = ptr->next;
-            if (munmap(ptr->addr, ptr->mmap_size) == 0){
-                head = next;
-            }
-        }
-    }
-    else if (ptr->next != NULL && ptr->next->addr != ptr->addr){
-        if (munmap(ptr->addr, ptr->mmap_size) == 0){
-            if (ptr != prev)
-                prev_prev->next = ptr->next;
-            else
-                prev->next = ptr->next;
-        }
     }
+    
+    // all memory in current block is free, so unmap
+    if (release_chunk(ptr) != 0)
+        tree_insert(ptr);
+}
 
-	return;
+block_t *cut_block(block_t *ptr, size_t size){
+    /*
+     * cut the block ptr after size bytes. the new block behind it gets the
+     * remaining length and, like ptr, is not free
+     */
+    block_t *nxt_new;
+    nxt_new = (block_t *) (((void *) ptr) + size);
+    nxt_new->length = ptr->length - size;
+    nxt_new->mmap_size = ptr->mmap_size;
+    nxt_new->addr = ptr->addr;
+    nxt_new->next = ptr->next;
+    nxt_new->prev = ptr;
+    nxt_new->left = NULL;
+    nxt_new->right = NULL;
+    nxt_new->free = 0;
+    nxt_new->source = ptr->source;
+
+    if (ptr->next != NULL)
+        ptr->next->prev = nxt_new;
+    ptr->next = nxt_new;
+    ptr->length = size;
+    return nxt_new;
 }
 
 void *split_block(block_t *new, size_t size){
@@ -236,47 +571,246 @@ void *split_block(block_t *new, size_t size){
      * 2.) new pointer with its length equal to remaining available memory
      */
     block_t *nxt_new;
-    nxt_new = (block_t *) (((void *) new) + size);
-    nxt_new->length = new->length - size;
-    nxt_new->mmap_size = new->mmap_size;
-    nxt_new->addr = new->addr;
-    nxt_new->next = new->next;
+    nxt_new = cut_block(new, size);
     nxt_new->free = 1;
-
-    new->next = nxt_new;
+    tree_insert(nxt_new);
     return NULL;
 }
 
-block_t *get_block(size_t raw_size){
+/* Size classes. A request of up to CLASS_MAX_SIZE bytes gets a block
+   of one of the lengths MIN_BLOCK + c * ALIGNMENT; c is its class for
+   the quick lists and the per-CPU caches. The classes are tabulated at
+   compile time for both placements, indexed by the request in 
+   ALIGNMENT steps: a plain block is the request plus the header, a 
+   block on cache lines (a request of LINE_STEPS steps or more, see 
+   cacheline_mode) is the request in whole lines plus the header line.
+   Longer requests have no class, their blocks are cut to measure. */
+#define CLASS_MAX_SIZE	((size_t) 1024)
+#define CLASS_INDEXES	(CLASS_MAX_SIZE / ALIGNMENT + 1)
+#define LINE_STEPS	(CACHELINE / ALIGNMENT)
+
+#define CLASS_PLAIN(i)	((i) > 0 ? (i) - 1 : 0)
+#define CLASS_LINE(i)	((i) < LINE_STEPS ? CLASS_PLAIN(i) : ALIGN_UP((size_t) (i), LINE_STEPS) - 1)
+
+#define CLASS_ROW4(f, i)	f(i), f(i + 1), f(i + 2), f(i + 3)
+#define CLASS_ROW16(f, i)	CLASS_ROW4(f, i), CLASS_ROW4(f, i + 4), \
+				CLASS_ROW4(f, i + 8), CLASS_ROW4(f, i + 12)
+#define CLASS_ROW64(f, i)	CLASS_ROW16(f, i), CLASS_ROW16(f, i + 16), \
+				CLASS_ROW16(f, i + 32), CLASS_ROW16(f, i + 48)
+
+static const unsigned char class_table[2][CLASS_INDEXES] = {
+    {CLASS_ROW64(CLASS_PLAIN, 0), CLASS_PLAIN(64)},
+    {CLASS_ROW64(CLASS_LINE, 0), CLASS_LINE(64)}
+};
+
+/* largest request __size_class_impl hands to the per-CPU caches */
+static size_t cache_max_size = CLASS_MAX_SIZE;
+
+static inline size_t size_class(size_t size){
+    // size must be 1 to CLASS_MAX_SIZE
+    return class_table[cacheline_mode][(size + ALIGNMENT - 1) / ALIGNMENT];
+}
+
+size_t block_need(size_t raw_size){
     /*
-     * find a pointer in a block of memory that:
-     * 1.) has enough length to cover the requested size + MEM_SIZE
-     * 2.) is free
+     * length of the block for a request of raw_size bytes, 0 on overflow
      */
-	block_t *cur; 
     size_t size;
-	if (head == NULL) return NULL; // no memory available
-    if (raw_size == 0) return NULL; 
 
-    size = raw_size + MEM_SIZE; 
-    if (size < raw_size) return NULL; // in case of overflow
+    if (raw_size - 1 < CLASS_MAX_SIZE) // no branch for 0
+        return MIN_BLOCK + size_class(raw_size) * ALIGNMENT;
 
-    cur = head;
-    while (cur->length < size || !cur->free){ 
-        cur = cur->next;
-        if (cur == NULL)
-            return NULL;
+    // every block with a line of payload or more gets whole lines
+    if (cacheline_mode && raw_size > CACHELINE - ALIGNMENT)
+        size = ALIGN_UP(raw_size, CACHELINE) + MEM_SIZE;
+    else
+        size = ALIGN_UP(raw_size + MEM_SIZE, ALIGNMENT);
+    if (size < raw_size) return 0;
+    return size;
+}
+
+static inline size_t line_gap(block_t *ptr){
+    return ALIGN_UP((size_t) ptr, CACHELINE) - (size_t) ptr;
+}
+
+// bytes in front of the free block ptr that align_block gives away
+static inline size_t align_cost(block_t *ptr){
+    size_t gap;
+
+    gap = line_gap(ptr);
+    if (gap != 0 && !ptr->prev->free) // too short for a header of its own
+        gap += CACHELINE;
+    return gap;
+}
+
+block_t *align_block(block_t *ptr){
+    /*
+     * move the free block ptr, which is out of the free tree, forward to the 
+     * next cache line. the bytes in front of it go to the previous block,
+     * which exists as blocks of memory start on a page, if that is free. 
+     * an allocated one keeps its length, which other threads may read 
+     * without the lock, and the bytes become a free block of their own, 
+     * one line longer so that they hold its header
+     */
+    block_t old, *new, *prev;
+    size_t gap;
+
+    gap = line_gap(ptr);
+    if (gap == 0)
+        return ptr;
+    prev = ptr->prev;
+    if (!prev->free){
+        new = cut_block(ptr, gap + CACHELINE);
+        ptr->free = 1;
+        tree_insert(ptr);
+        return new;
     }
-    
+
+    old = *ptr; // the new header overlaps the old one
+    new = (block_t *) (((void *) ptr) + gap);
+    new->addr = old.addr;
+    new->length = old.length - gap;
+    new->mmap_size = old.mmap_size;
+    new->next = old.next;
+    new->prev = prev;
+    new->left = NULL;
+    new->right = NULL;
+    new->free = old.free;
+    new->source = old.source;
+    prev->next = new;
+    if (new->next != NULL)
+        new->next->prev = new;
+
+    tree_remove(prev);
+    unpurge_block(prev);
+    prev->length += gap;
+    tree_insert(prev);
+    return new;
+}
+
+block_t *fit_block(size_t size, int aligned){
+    /*
+     * take the best fitting free block for a block of size bytes out of the 
+     * tree, on a cache line if aligned, and split off what it does not need
+     */
+    block_t *cur;
+
+    cur = tree_best_fit(size);
+    if (cur != NULL && aligned && cur->length - size < align_cost(cur)){
+        if (size + 2 * CACHELINE < size) return NULL;
+        cur = tree_best_fit(size + 2 * CACHELINE - ALIGNMENT); // room for any cost
+    }
+    if (cur == NULL)
+        return NULL;
+
+    tree_remove(cur);
+    unpurge_block(cur);
+    if (aligned)
+        cur = align_block(cur);
     cur->free = 0;
-    // is there enough memory available in the block that cur is on
-    // to split the block further?
-    if ((cur->length - size) > MEM_SIZE){ 
+    if ((cur->length - size) >= MIN_BLOCK){ 
         split_block(cur, size);
     } 
+    return cur;
+}
 
-    cur->length = size;    
-	return cur;
+size_t block_class(block_t *ptr){
+    /*
+     * size class of the allocated block ptr for the quick lists and the
+     * per-CPU caches: its length in ALIGNMENT steps above MIN_BLOCK. 
+     * (size_t) -1 for blocks that must be released right away
+     */
+    size_t length;
+
+    if (ptr->length == ptr->mmap_size) // a mapping of its own
+        return (size_t) -1;
+    if (inherited_count != 0 && block_inherited(ptr))
+        return (size_t) -1;
+    // a block longer than needed goes to the largest class it can serve
+    length = ptr->length;
+    if (cacheline_mode && length >= MEM_SIZE + CACHELINE){
+        if (line_gap(ptr) == 0)
+            length &= ~(CACHELINE - 1);
+        else // e.g. from memalign, only serves requests below a line
+            length = MEM_SIZE + CACHELINE - ALIGNMENT;
+    }
+    return (length - MIN_BLOCK) / ALIGNMENT;
+}
+
+void consolidate(void){
+    /*
+     * merge all blocks of the quick lists into the heap
+     */
+    block_t *cur, *next;
+    size_t i;
+
+    for (i = 0; i < QUICK_CLASSES; i++){
+        for (cur = quick[i]; cur != NULL; cur = next){
+            next = *((block_t **) (((void *) cur) + MEM_SIZE));
+            remove_block(cur);
+        }
+        quick[i] = NULL;
+    }
+    quick_bytes = 0;
+}
+
+void release_block(block_t *ptr){
+    /*
+     * give the allocated block ptr back: onto its quick list in deferred mode
+     * if it is short enough, into the heap otherwise
+     */
+    size_t c;
+
+    c = defer_mode ? block_class(ptr) : (size_t) -1;
+    if (c >= QUICK_CLASSES){
+        remove_block(ptr);
+        return;
+    }
+    *((block_t **) (((void *) ptr) + MEM_SIZE)) = quick[c];
+    quick[c] = ptr;
+    quick_bytes += ptr->length;
+    if (quick_bytes > QUICK_MAX_BYTES)
+        consolidate();
+}
+
+block_t *quick_block(size_t c){
+    /*
+     * take a block of class c from its quick list
+     */
+    block_t *cur;
+
+    if (c >= QUICK_CLASSES || quick[c] == NULL)
+        return NULL;
+    cur = quick[c];
+    quick[c] = *((block_t **) (((void *) cur) + MEM_SIZE));
+    quick_bytes -= cur->length;
+    return cur;
+}
+
+block_t *get_block(size_t raw_size){
+    /*
+     * find the best fitting pointer in a block of memory that:
+     * 1.) has enough length to cover the requested size + MEM_SIZE
+     * 2.) is free
+     */
+    block_t *cur;
+    size_t size;
+    int aligned;
+    if (raw_size == 0) return NULL; 
+
+    size = block_need(raw_size);
+    if (size == 0) return NULL; // in case of overflow
+
+    aligned = cacheline_mode && raw_size > CACHELINE - ALIGNMENT;
+    cur = NULL;
+    if (free_tree != NULL)
+        cur = fit_block(size, aligned);
+    // the quick lists may hold the neighbours of a fitting block
+    if (cur == NULL && quick_bytes != 0){
+        consolidate();
+        cur = fit_block(size, aligned);
+    }
+    return cur;
 }
 
 void *add_block(block_t *new){
@@ -304,37 +838,307 @@ void *add_block(block_t *new){
         prev->next = new;
         new->next = cur;
     }
+    new->prev = prev;
+    if (cur != NULL)
+        cur->prev = new;
 
     return NULL;
 }
 
-void *new_block(size_t raw_size){
+void prefault(void *ptr, size_t length){
     /*
-     * generate a new block of memory by using mmap
+     * fault in all pages of a mapping, by one write per page if the kernel
+     * cannot do it
+     */
+    volatile unsigned char *p;
+    size_t i;
+
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(ptr, length, MADV_POPULATE_WRITE) == 0) return;
+#endif
+    for (i = 0, p = (volatile unsigned char *) ptr; i < length; i += PAGE_SIZE)
+        p[i] = 0;
+}
+
+void *map_huge(size_t length){
+    /*
+     * map length bytes, a multiple of HUGE_PAGE_SIZE, on huge pages
+     */
+    void *ptr, *aligned;
+    size_t head_size, tail_size;
+
+#ifdef MAP_HUGETLB
+    if (thp_mode == THP_HUGETLB){
+        ptr = mmap(NULL, length, PROT_READ | PROT_WRITE, 
+                   MAP_ANONYMOUS | MAP_PRIVATE | MAP_HUGETLB | (populate ? MAP_POPULATE : 0),
+                   -1, 0);
+        if (ptr != MAP_FAILED) return ptr;
+    }
+#endif
+
+    // over-map by one huge page, then cut off what lies outside the aligned part
+    if (length + HUGE_PAGE_SIZE < length) return MAP_FAILED;
+	ptr = mmap(NULL, length + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (ptr == MAP_FAILED) return MAP_FAILED;
+
+    aligned = (void *) ALIGN_UP((size_t) ptr, HUGE_PAGE_SIZE);
+    head_size = (size_t) (aligned - ptr);
+    tail_size = HUGE_PAGE_SIZE - head_size;
+    if (head_size != ((size_t) 0))
+        munmap(ptr, head_size);
+    if (tail_size != ((size_t) 0))
+        munmap(aligned + length, tail_size);
+
+#ifdef MADV_HUGEPAGE
+    madvise(aligned, length, MADV_HUGEPAGE); // only a hint, failure is fine
+#endif
+    // MAP_POPULATE would have faulted in small pages before the advice
+    if (populate)
+        prefault(aligned, length);
+    return aligned;
+}
+
+size_t __purge_impl(size_t, size_t);
+
+size_t over_limit(size_t length){
+    /*
+     * by how many bytes a new mapping of length bytes would exceed the limit
+     */
+    size_t usage;
+
+    usage = mapped_bytes - purged_bytes;
+    if (heap_limit == 0 || (usage + length >= usage && usage + length <= heap_limit))
+        return 0;
+    if (usage + length < usage)
+        return (size_t) -1;
+    return usage + length - heap_limit;
+}
+
+int within_limit(size_t length){
+    /*
+     * make room under the limit for a new mapping of length bytes: first 
+     * purge free memory, then ask the application. 1 if it fits then
+     */
+    size_t over;
+
+    over = over_limit(length);
+    if (over == 0)
+        return 1;
+    __purge_impl(0, over);
+    over = over_limit(length);
+    if (over == 0)
+        return 1;
+
+    // only one thread calls the hook at a time, others fail meanwhile
+    // (see heap_limit)
+    if (pressure_hook == NULL || in_pressure)
+        return 0;
+    in_pressure = 1;
+    pressure_hook(over);
+    in_pressure = 0;
+    over = over_limit(length);
+    if (over != 0)
+        __purge_impl(0, over);
+    return over_limit(length) == 0;
+}
+
+block_t *map_block(size_t length){
+    /*
+     * map length bytes and add them to the list as one block that is not free
      */
     void *ptr;
 	block_t *new;
-	size_t length, size;
-    if (raw_size == 0) return NULL;
-    size = raw_size + MEM_SIZE;
-    length = MMAP_MIN_SIZE;
-	if (size > length) // if size is greater than min map, then set length = size
-		length = size;
-
-	ptr = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-	if (ptr == MAP_FAILED) return NULL;
+    size_t size;
+    int source, huge;
+
+    // the current source, falling back to mmap when it is exhausted; 
+    // the limit applies to the size that is really mapped
+    ptr = NULL;
+    source = current_source;
+    if (source != 0){
+        size = ALIGN_UP(length, sources[source].unit);
+        if (size < length || !within_limit(size))
+            return NULL;
+        ptr = sources[source].alloc(size, sources[source].arg);
+    }
+    if (ptr == NULL){
+        source = 0;
+        huge = thp_mode != THP_OFF && length >= HUGE_PAGE_SIZE;
+        size = huge ? ALIGN_UP(length, HUGE_PAGE_SIZE) : length;
+        if (size < length || !within_limit(size))
+            return NULL;
+        if (huge)
+            ptr = map_huge(size);
+        else
+            ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, 
+                       MAP_ANONYMOUS | MAP_PRIVATE | (populate ? MAP_POPULATE : 0), -1, 0);
+        if (ptr == MAP_FAILED) return NULL;
+    }
+    length = size;
 
     new = (block_t *) ptr;
 	new->length = length;
 	new->mmap_size = length;
 	new->addr = ptr; 
-    new->free = 1;
+    new->free = 0;
+    new->source = source;
     new->next = NULL;
+    new->left = NULL;
+    new->right = NULL;
+    mapped_bytes += length;
 
     add_block(new); // add block to linked list
+    return new;
+}
+
+void *new_block(size_t raw_size){
+    /*
+     * generate a new block of memory by using mmap
+     */
+	block_t *new;
+	size_t length, size;
+    if (raw_size == 0) return NULL;
+    size = ALIGN_UP(raw_size + MEM_SIZE, PAGE_SIZE);
+    if (size < raw_size) return NULL; // in case of overflow
+    length = chunk_size;
+	if (size > length) // if size is greater than min map, then set length = size
+		length = size;
+
+    new = map_block(length);
+    if (new == NULL) return NULL;
+    new->free = 1;
+    tree_insert(new);
     return NULL;
 }
 
+void reserve_memory(size_t size){
+    /*
+     * map and prefault the reserve as a free chunk of its own
+     */
+    block_t *new;
+    int old_populate;
+
+    if (size == 0 || reserve_addr != NULL) return;
+    old_populate = populate;
+    populate = 1;
+    new = map_block(ALIGN_UP(size, PAGE_SIZE));
+    populate = old_populate;
+    if (new == NULL) return;
+
+    reserve_addr = new->addr;
+    new->free = 1;
+    tree_insert(new);
+}
+
+block_t *large_block(size_t raw_size){
+    /*
+     * generate a mapping of its own for a large request
+     */
+	size_t size;
+    if (raw_size == 0) return NULL;
+    size = ALIGN_UP(raw_size + MEM_SIZE, PAGE_SIZE);
+    if (size < raw_size) return NULL; // in case of overflow
+    return map_block(size);
+}
+
+void push_remote_free(block_t *ptr){
+    /*
+     * push a block onto the remote free queue without taking the lock
+     */
+    block_t **link, *old;
+    link = (block_t **) (((void *) ptr) + MEM_SIZE);
+    old = __atomic_load_n(&remote_frees, __ATOMIC_RELAXED);
+    do {
+        *link = old;
+    } while (!__atomic_compare_exchange_n(&remote_frees, &old, ptr, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+void drain_remote_frees(void){
+    /*
+     * give all blocks of the remote free queue back to the heap in one batch.
+     * must be called with the memory management lock held
+     */
+    block_t *cur, *next;
+    if (__atomic_load_n(&remote_frees, __ATOMIC_RELAXED) == NULL) return;
+
+    cur = __atomic_exchange_n(&remote_frees, NULL, __ATOMIC_ACQUIRE);
+    while (cur != NULL){
+        next = *((block_t **) (((void *) cur) + MEM_SIZE));
+        release_block(cur);
+        cur = next;
+    }
+}
+
+void inherit_blocks(void){
+    /*
+     * called in a forked child: moves every block of memory of the list into 
+     * the sorted inherited table and starts over with an empty heap
+     */
+    block_t *cur;
+    range_t *table;
+    size_t count, map_size, i, j;
+    void *last;
+
+    count = 0;
+    last = NULL;
+    for (cur = head; cur != NULL; cur = cur->next){
+        if (cur->addr != last)
+            count++;
+        last = cur->addr;
+    }
+    if (count == 0) return;
+
+    map_size = ALIGN_UP((inherited_count + count) * sizeof(range_t), PAGE_SIZE);
+    table = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (table == MAP_FAILED) return; // the child just writes into shared pages
+
+    // merge the old table and the list, both are sorted by address
+    i = 0;
+    j = 0;
+    cur = head;
+    while (cur != NULL || i < inherited_count){
+        if (cur == NULL || (i < inherited_count && inherited[i].addr < cur->addr)){
+            table[j++] = inherited[i++];
+            continue;
+        }
+        table[j].addr = cur->addr;
+        table[j].length = cur->mmap_size;
+        j++;
+        for (last = cur->addr; cur != NULL && cur->addr == last; cur = cur->next);
+    }
+
+    if (inherited != NULL)
+        munmap(inherited, inherited_map_size);
+    inherited = table;
+    inherited_count = j;
+    inherited_map_size = map_size;
+
+    head = NULL;
+    free_tree = NULL;
+    __memset(quick, 0, sizeof(quick)); // inherited blocks, never reused
+    quick_bytes = 0;
+    mapped_bytes = 0; // shared with the parent, not charged to the child
+    purged_bytes = 0;
+}
+
+size_t purge_block(block_t *ptr){
+    /*
+     * give the pages inside the free block ptr back to the kernel, all of
+     * them, as purged_bytes and unpurge_block count whole blocks. the header
+     * stays. returns the number of bytes purged
+     */
+    void *start;
+    size_t length;
+
+    length = block_interior(ptr, &start);
+    if (length == 0)
+        return 0;
+    if (madvise(start, length, MADV_DONTNEED) != 0)
+        return 0;
+    return length;
+}
+
 /* End of your helper functions */
 
 /* Start of the actual malloc/calloc/realloc/free functions */
@@ -347,17 +1151,32 @@ void *__malloc_impl(size_t size) {
 
 	if (size == ((size_t) 0)) return NULL;
 
+    drain_remote_frees();
+
 	s = size + MEM_SIZE;
 	if (s < size) return NULL;
 
-	ptr = (void *) get_block(s);  
+    if (size >= large_threshold){
+        ptr = (void *) large_block(size);
+        if (ptr != NULL)
+            return ptr + MEM_SIZE;
+        return NULL;
+    }
+
+    if (quick_bytes != 0 && size <= CLASS_MAX_SIZE){
+        ptr = (void *) quick_block(size_class(size));
+        if (ptr != NULL)
+            return ptr + MEM_SIZE;
+    }
+
+	ptr = (void *) get_block(size);  
 
 	if (ptr != NULL)
 		return ptr + MEM_SIZE;
 
-    new_block(s);
+    new_block(size);
 
-	ptr = (void *) get_block(s);  
+	ptr = (void *) get_block(size);  
 
 	if (ptr != NULL)
 		return ptr + MEM_SIZE;
@@ -395,7 +1214,7 @@ void *__realloc_impl(void *ptr, size_t size) {
     if (new_ptr == NULL ) return NULL;
 
     old_block = (block_t *) (ptr - MEM_SIZE);
-    s = old_block->length;
+    s = old_block->length - MEM_SIZE; // length counts the header too
 
     if (size < s){
       s = size;
@@ -408,8 +1227,968 @@ void *__realloc_impl(void *ptr, size_t size) {
 
 void __free_impl(void *ptr) {
     if (ptr != NULL)
-        remove_block(ptr - MEM_SIZE);
+        release_block(ptr - MEM_SIZE);
     return;
 }
 
+/* Like __malloc_impl, but the payload is aligned to alignment, which
+   must be a power of two. 
+
+   A block large enough to contain an aligned payload anywhere in it is
+   allocated. The part before the aligned payload (which is made large
+   enough to hold a block of its own) and the unused tail are given
+   back to the heap.
+
+*/
+void *__memalign_impl(size_t alignment, size_t size) {
+    void *ptr;
+    block_t *block, *lead;
+    size_t s, gap, need;
+
+    if (alignment <= ALIGNMENT) return __malloc_impl(size);
+    if ((alignment & (alignment - ((size_t) 1))) != ((size_t) 0)) return NULL;
+    if (size == ((size_t) 0)) return NULL;
+
+    need = block_need(size);
+    if (need == 0) return NULL;
+    s = need + alignment;
+    if (s < need) return NULL;
+    s += MIN_BLOCK;
+    if (s < MIN_BLOCK) return NULL;
+
+    ptr = __malloc_impl(s);
+    if (ptr == NULL) return NULL;
+    block = (block_t *) (ptr - MEM_SIZE);
+
+    gap = ALIGN_UP((size_t) ptr, alignment) - ((size_t) ptr);
+    if (gap != ((size_t) 0)){
+        while (gap < MIN_BLOCK)
+            gap += alignment;
+        lead = block;
+        block = cut_block(lead, gap);
+        remove_block(lead);
+    }
+
+    if (block->length - need >= MIN_BLOCK)
+        remove_block(cut_block(block, need));
+
+    return ((void *) block) + MEM_SIZE;
+}
+
+/* A block whose payload has whole cache lines to itself, whatever the
+   cache line placement of other requests is. */
+void *__malloc_cacheline_impl(size_t size) {
+    block_t *block;
+    size_t s;
+
+    if (size == ((size_t) 0)) return NULL;
+    s = ALIGN_UP(size, CACHELINE);
+    if (s < size) return NULL;
+    if (s >= large_threshold) // a mapping of its own starts on a page
+        return __malloc_impl(s);
+
+    drain_remote_frees();
+
+    s += MEM_SIZE;
+    block = fit_block(s, 1);
+    if (block == NULL){
+        new_block(s - MEM_SIZE);
+        block = fit_block(s, 1);
+    }
+    if (block == NULL) return NULL;
+    return ((void *) block) + MEM_SIZE;
+}
+
+/* Allocates n blocks of size bytes each, storing them into ptrs.
+   Returns how many blocks could be allocated; these are the first
+   ones in ptrs.
+
+   The blocks are carved out of as few free blocks as possible, one
+   best-fit lookup for (at most) a whole chunk worth of them. They
+   hence end up next to each other, which is what a caller that frees
+   them all at once wants as well.
+
+*/
+size_t __malloc_batch_impl(size_t size, void **ptrs, size_t n) {
+    block_t *block;
+    size_t bs, k, done;
+
+    if (size == ((size_t) 0)) return 0;
+    bs = block_need(size);
+    if (bs == 0) return 0;
+
+    drain_remote_frees();
+
+    done = 0;
+    while (done < n){
+        k = n - done;
+        if (k > chunk_size / bs) // do not force huge chunks
+            k = chunk_size / bs;
+        if (k == ((size_t) 0))
+            k = 1;
+
+        block = get_block(k * bs - MEM_SIZE);
+        if (block == NULL){
+            new_block(k * bs - MEM_SIZE);
+            block = get_block(k * bs - MEM_SIZE);
+        }
+        if (block == NULL)
+            break;
+
+        for (; k > 1; k--){
+            ptrs[done++] = ((void *) block) + MEM_SIZE;
+            block = cut_block(block, bs);
+        }
+        ptrs[done++] = ((void *) block) + MEM_SIZE;
+    }
+    return done;
+}
+
+/* Same as __free_impl but may be called without holding the memory
+   management lock. The block is only queued; the next __malloc_impl
+   releases it. */
+void __free_remote_impl(void *ptr) {
+    if (ptr != NULL)
+        push_remote_free(ptr - MEM_SIZE);
+    return;
+}
+
+/* Regions
+
+   __region_alloc_impl only bumps the pointer of the region and does not
+   touch the heap, so it needs no lock. It returns NULL if the current
+   block of the region is exhausted; __region_refill_impl, called with
+   the memory management lock held, then adds a new block to the
+   region and allocates from it.
+
+*/
+region_t *__region_create_impl(void) {
+    region_t *region;
+
+    region = (region_t *) __malloc_impl(sizeof(region_t));
+    if (region == NULL) return NULL;
+    region->blocks = NULL;
+    region->cur = NULL;
+    region->end = NULL;
+    region->next_size = REGION_MIN_SIZE;
+    return region;
+}
+
+void *__region_alloc_impl(region_t *region, size_t size) {
+    void *ptr;
+    size_t s;
+
+    if (size == ((size_t) 0)) return NULL;
+    s = ALIGN_UP(size, ALIGNMENT);
+    if (s < size) return NULL;
+    if (((size_t) (region->end - region->cur)) < s) return NULL;
+
+    ptr = region->cur;
+    region->cur += s;
+    return ptr;
+}
+
+void *__region_refill_impl(region_t *region, size_t size) {
+    block_t *block;
+    size_t s, length;
+
+    if (size == ((size_t) 0)) return NULL;
+    s = ALIGN_UP(size, ALIGNMENT) + ALIGNMENT; // room for the link
+    if (s < size) return NULL;
+
+    drain_remote_frees();
+
+    length = region->next_size;
+    if (length < s)
+        length = s;
+    block = get_block(length);
+    if (block == NULL){
+        new_block(length);
+        block = get_block(length);
+    }
+    if (block == NULL) return NULL;
+
+    *((block_t **) (((void *) block) + MEM_SIZE)) = region->blocks;
+    region->blocks = block;
+    region->cur = ((void *) block) + MEM_SIZE + ALIGNMENT;
+    region->end = ((void *) block) + block->length;
+    if (region->next_size < REGION_MAX_SIZE)
+        region->next_size *= 2;
+
+    return __region_alloc_impl(region, size);
+}
+
+void __region_destroy_impl(region_t *region) {
+    block_t *cur, *next;
+
+    if (region == NULL) return;
+    for (cur = region->blocks; cur != NULL; cur = next){
+        next = *((block_t **) (((void *) cur) + MEM_SIZE));
+        remove_block(cur);
+    }
+    __free_impl(region);
+}
+
+/* Purging
+
+   Free memory normally stays mapped until a whole block of memory is
+   free, and the last chunk and the reserve stay mapped even then.
+   __purge_impl gives free memory back to the kernel on request: it 
+   unmaps the blocks of memory that are entirely free and drops the 
+   pages inside the other free blocks with MADV_DONTNEED, which keeps them mapped, so they are faulted back in
+   as zero pages when the block is reused. Free blocks whose pages were
+   dropped have free set to 2, which a merge or split resets to 1, so
+   they are not purged again. The reserve is left alone altogether, as
+   it is there to stay warm. Blocks in the per-CPU cache of the 
+   current CPU, the remote frees and the quick lists are given back to
+   the heap first; the other CPUs are asked to empty their caches.
+
+   The first pad bytes of free memory found are left alone; the purge
+   stops once bytes bytes were released (0 for no limit). Free blocks
+   are purged whole, so the last one may take it beyond bytes: the
+   accounting of purged_bytes, which the soft limit relies on, only 
+   knows whole blocks. Returns the number of bytes released.
+
+*/
+size_t __purge_impl(size_t pad, size_t bytes) {
+    block_t *cur, *next;
+    size_t kept, done, length;
+
+    if (cache_flush_hook != NULL)
+        cache_flush_hook();
+    drain_remote_frees();
+    consolidate();
+
+    kept = 0;
+    done = 0;
+    for (cur = head; cur != NULL && (bytes == 0 || done < bytes); cur = next){
+        next = cur->next;
+        if (!cur->free || cur->addr == reserve_addr)
+            continue;
+        if (kept < pad){
+            kept += cur->length;
+            continue;
+        }
+        if (cur->length == cur->mmap_size){
+            length = cur->mmap_size;
+            tree_remove(cur);
+            unpurge_block(cur);
+            if (release_chunk(cur) == 0){
+                done += length;
+                continue;
+            }
+            tree_insert(cur);
+        }
+        if (cur->free == 2)
+            continue;
+        length = purge_block(cur);
+        done += length;
+        if (length != 0){
+            cur->free = 2;
+            purged_bytes += length;
+        }
+    }
+    return done;
+}
+
+/* Purges the unused rest of the current block of a region, from its
+   end. Needs no lock, as the region only belongs to the calling thread
+   and its memory is not in the heap's free tree. */
+size_t __region_purge_impl(region_t *region, size_t bytes) {
+    void *start, *end;
+
+    start = (void *) ALIGN_UP((size_t) region->cur, PAGE_SIZE);
+    end = (void *) (((size_t) region->end) & ~(PAGE_SIZE - 1));
+    if (region->cur == NULL || end <= start)
+        return 0;
+    if (bytes != 0 && (size_t) (end - start) > ALIGN_UP(bytes, PAGE_SIZE))
+        start = end - ALIGN_UP(bytes, PAGE_SIZE);
+    if (madvise(start, end - start, MADV_DONTNEED) != 0)
+        return 0;
+    return end - start;
+}
+
+/* Registers a chunk source and makes it the current one; alloc NULL 
+   makes mmap the current source again. alloc is called with a
+   multiple of unit (0 for the page size) and must return page aligned
+   memory or NULL; dalloc gets back exactly that address and length 
+   and returns 0 if it took the memory back. Returns the index of the 
+   source or -1 if there are too many sources. */
+int __set_chunk_hooks_impl(void *(*alloc)(size_t, void *),
+                           int (*dalloc)(void *, size_t, void *), void *arg,
+                           size_t unit) {
+    int i;
+
+    if (alloc == NULL || dalloc == NULL){
+        current_source = 0;
+        return 0;
+    }
+    for (i = 1; i < source_count; i++){
+        if (sources[i].alloc == alloc && sources[i].dalloc == dalloc && 
+            sources[i].arg == arg)
+            break;
+    }
+    if (i == source_count){
+        if (source_count == MAX_SOURCES) return -1;
+        sources[i].alloc = alloc;
+        sources[i].dalloc = dalloc;
+        sources[i].arg = arg;
+        source_count++;
+    }
+    sources[i].unit = (unit == 0) ? PAGE_SIZE : ALIGN_UP(unit, PAGE_SIZE);
+    current_source = i;
+    return i;
+}
+
+/* Persistent heaps
+
+   A persistent heap lives in a file mapped by the caller and may be
+   mapped at a different address each time, so nothing in it is a
+   pointer: like the file system of the next assignment, the heap only
+   stores offsets from its start, offset 0 meaning none. It starts with
+   a pheader_t header, followed by blocks that tile the rest of the file.
+   Each block has a pblock_t header whose size includes the header and
+   whose lowest bit marks the block as allocated. Free blocks are
+   linked in address order, so that a freed block is merged with its
+   neighbours; allocation takes the first fit.
+
+   The blocks' sizes are the only thing that must be right: the free
+   list is rebuilt from them when the heap is opened after it was not
+   closed properly. Every operation updates them so that the blocks
+   tile the heap at any time, committing with a single store of a
+   size; a crash in the middle of an operation hence leaves the heap
+   consistent, at worst with a leaked block.
+
+*/
+#define PHEAP_MAGIC	((size_t) 0x7061656870796d6d) // "mmypheap"
+#define PHEAP_USED	((size_t) 1)
+
+typedef size_t offset_t;
+
+typedef struct struct_pheader_t{
+    size_t magic;
+    size_t size; // bytes of the heap, header included
+    offset_t free_list;
+    offset_t root;
+    size_t clean; // closed properly, the free list can be trusted
+} __attribute__((aligned(64))) pheader_t;
+
+typedef struct struct_pblock_t{
+    size_t size; // bytes of the block, header included | PHEAP_USED
+    offset_t next; // next free block, only valid while free
+} pblock_t;
+
+#define PHEAP_FIRST	(sizeof(pheader_t)) // offset of the first block
+#define PBLOCK_SIZE	(sizeof(pblock_t))
+#define PBLOCK_MIN	(PBLOCK_SIZE + ALIGNMENT)
+
+static inline pblock_t *pheap_block(pheader_t *heap, offset_t offset){
+    return (pblock_t *) (((void *) heap) + offset);
+}
+
+static inline void pheap_commit(size_t *dst, size_t value){
+    __atomic_store_n(dst, value, __ATOMIC_RELEASE);
+}
+
+/* Walks the blocks, merging neighbouring free blocks and linking them.
+   Returns -1 if the sizes do not tile the heap. */
+static int pheap_rebuild(pheader_t *heap){
+    offset_t off, last;
+    pblock_t *block, *prev;
+    size_t length;
+
+    heap->free_list = (offset_t) 0;
+    prev = NULL;
+    last = (offset_t) 0;
+    for (off = PHEAP_FIRST; off < heap->size; off += length){
+        block = pheap_block(heap, off);
+        length = block->size & ~PHEAP_USED;
+        if (length < PBLOCK_SIZE || length > heap->size - off ||
+            (length % ALIGNMENT) != ((size_t) 0))
+            return -1;
+        if (block->size & PHEAP_USED){
+            prev = NULL;
+        } else if (prev != NULL){
+            pheap_commit(&prev->size, prev->size + length);
+        } else {
+            block->next = (offset_t) 0;
+            if (last == (offset_t) 0)
+                heap->free_list = off;
+            else
+                pheap_block(heap, last)->next = off;
+            last = off;
+            prev = block;
+        }
+    }
+    return 0;
+}
+
+void __pfree_impl(void *, void *);
+
+/* Opens the heap of size bytes at base, formatting it if it does not
+   hold a heap yet. A heap that grew since it was created gets the new
+   space as a free block at its end. Returns -1 if base holds something
+   else or a damaged heap. */
+int __pheap_open_impl(void *base, size_t size) {
+    pheader_t *heap = (pheader_t *) base;
+    pblock_t *block;
+    size_t old;
+
+    size &= ~(ALIGNMENT - ((size_t) 1));
+    if (size < PHEAP_FIRST + PBLOCK_MIN) return -1;
+
+    if (heap->magic != PHEAP_MAGIC){
+        if (heap->magic != ((size_t) 0)) return -1;
+        heap->size = PHEAP_FIRST;
+        heap->root = (offset_t) 0;
+        heap->clean = 0;
+        __atomic_store_n(&heap->magic, PHEAP_MAGIC, __ATOMIC_RELEASE);
+    }
+    if (heap->size > size) return -1;
+    if (!heap->clean && pheap_rebuild(heap) < 0) return -1;
+    heap->clean = 0;
+
+    if (size - heap->size >= PBLOCK_MIN){
+        old = heap->size;
+        block = pheap_block(heap, old);
+        block->size = size - old;
+        pheap_commit(&heap->size, size);
+        __pfree_impl(base, ((void *) block) + PBLOCK_SIZE);
+    }
+    return 0;
+}
+
+void __pheap_close_impl(void *base) {
+    pheap_commit(&((pheader_t *) base)->clean, 1);
+}
+
+void *__pmalloc_impl(void *base, size_t size) {
+    pheader_t *heap = (pheader_t *) base;
+    pblock_t *block, *rest;
+    offset_t off, *link;
+    size_t s;
+
+    if (size == ((size_t) 0)) return NULL;
+    s = ALIGN_UP(size, ALIGNMENT) + PBLOCK_SIZE;
+    if (s < size) return NULL;
+
+    for (link = &heap->free_list; *link != (offset_t) 0; link = &block->next){
+        off = *link;
+        block = pheap_block(heap, off);
+        if (block->size < s) continue;
+        if (block->size - s >= PBLOCK_MIN){
+            /* The rest is written while still inside the block, then
+               takes its place in the list; the block only shrinks
+               when it is marked as allocated. */
+            rest = pheap_block(heap, off + s);
+            rest->size = block->size - s;
+            rest->next = block->next;
+            *link = off + s;
+        } else {
+            s = block->size;
+            *link = block->next;
+        }
+        pheap_commit(&block->size, s | PHEAP_USED);
+        return ((void *) block) + PBLOCK_SIZE;
+    }
+    return NULL;
+}
+
+void __pfree_impl(void *base, void *ptr) {
+    pheader_t *heap = (pheader_t *) base;
+    pblock_t *block, *prev, *next;
+    offset_t off, *link;
+
+    if (ptr == NULL) return;
+    block = (pblock_t *) (ptr - PBLOCK_SIZE);
+    off = (offset_t) (((void *) block) - base);
+
+    prev = NULL;
+    for (link = &heap->free_list; *link != (offset_t) 0 && *link < off; 
+         link = &prev->next)
+        prev = pheap_block(heap, *link);
+
+    block->next = *link;
+    pheap_commit(&block->size, block->size & ~PHEAP_USED);
+    if (block->next != (offset_t) 0 && block->next == off + block->size){
+        next = pheap_block(heap, block->next);
+        block->next = next->next;
+        pheap_commit(&block->size, block->size + next->size);
+    }
+    if (prev != NULL && 
+        ((void *) prev) + prev->size == (void *) block){
+        prev->next = block->next;
+        pheap_commit(&prev->size, prev->size + block->size);
+    } else {
+        *link = off;
+    }
+}
+
+void *__pheap_root_impl(void *base) {
+    pheader_t *heap = (pheader_t *) base;
+
+    if (heap->root == (offset_t) 0) return NULL;
+    return base + heap->root;
+}
+
+void __pheap_set_root_impl(void *base, void *ptr) {
+    pheap_commit(&((pheader_t *) base)->root,
+                 (ptr == NULL) ? (offset_t) 0 : (offset_t) (ptr - base));
+}
+
+/* Heap inspection
+
+   __inspect_impl walks all blocks of memory and describes them as JSON,
+   which it hands to emit piece by piece, as it must not allocate:
+
+   {"mapped_bytes": ..., "purged_bytes": ..., "remote_frees": ...,
+    "quick_bytes": ...,
+    "free_bytes": ..., "free_blocks": ..., "largest_free": ...,
+    "fragmentation": ...,
+    "histogram": [{"min": 16, "count": ..., "bytes": ...}, ...],
+    "chunks": [{"addr": "0x...", "size": ..., "source": ..., 
+                "blocks": ..., "used_bytes": ..., "free_blocks": ...,
+                "free_bytes": ..., "purged_bytes": ..., 
+                "largest_free": ..., "map": "0123..."}, ...]}
+
+   Sizes are in bytes and include the headers. fragmentation is the 
+   external fragmentation 1 - largest_free / free_bytes, in thousandths.
+   The histogram counts the free blocks by powers of two of their 
+   length. map shows the occupancy of the chunk in INSPECT_CELLS cells
+   of equal size, from 0 (free) to 9 (fully used). Must be called with
+   the memory management lock held.
+
+*/
+#define INSPECT_CELLS	64
+#define INSPECT_BUCKETS	(8 * sizeof(size_t))
+
+typedef struct struct_inspect_t{
+    void (*emit)(const char *, size_t, void *);
+    void *arg;
+    char buf[256];
+    size_t len;
+} inspect_t;
+
+static void inspect_flush(inspect_t *out){
+    if (out->len != 0)
+        out->emit(out->buf, out->len, out->arg);
+    out->len = 0;
+}
+
+static void inspect_str(inspect_t *out, const char *str){
+    for (; *str != '\0'; str++){
+        if (out->len == sizeof(out->buf))
+            inspect_flush(out);
+        out->buf[out->len++] = *str;
+    }
+}
+
+static void inspect_num(inspect_t *out, size_t value, unsigned int base){
+    char digits[2 * sizeof(size_t) * 4 + 1];
+    size_t i;
+
+    i = sizeof(digits) - 1;
+    digits[i] = '\0';
+    do {
+        digits[--i] = "0123456789abcdef"[value % base];
+        value /= base;
+    } while (value != 0);
+    inspect_str(out, &digits[i]);
+}
+
+static void inspect_field(inspect_t *out, const char *key, size_t value){
+    inspect_str(out, "\"");
+    inspect_str(out, key);
+    inspect_str(out, "\": ");
+    inspect_num(out, value, 10);
+}
+
+static void inspect_chunk(inspect_t *out, block_t *first){
+    block_t *cur;
+    size_t cells[INSPECT_CELLS];
+    size_t used, free_bytes, free_blocks, purged, largest, blocks;
+    size_t cell, start, end, part, i;
+    void *interior;
+    char map[INSPECT_CELLS + 1];
+
+    __memset(cells, 0, sizeof(cells));
+    used = free_bytes = free_blocks = purged = largest = blocks = 0;
+    cell = ALIGN_UP(first->mmap_size, INSPECT_CELLS) / INSPECT_CELLS;
+    for (cur = first; cur != NULL && cur->addr == first->addr; cur = cur->next){
+        blocks++;
+        if (cur->free){
+            free_blocks++;
+            free_bytes += cur->length;
+            if (cur->length > largest)
+                largest = cur->length;
+            if (cur->free == 2)
+                purged += block_interior(cur, &interior);
+            continue;
+        }
+        used += cur->length;
+        // spread the block over the cells it covers
+        start = (size_t) (((void *) cur) - cur->addr);
+        end = start + cur->length;
+        while (start < end){
+            i = start / cell;
+            part = (i + 1) * cell;
+            if (part > end)
+                part = end;
+            cells[i] += part - start;
+            start = part;
+        }
+    }
+    for (i = 0; i < INSPECT_CELLS; i++)
+        map[i] = '0' + (char) ((cells[i] * 9 + cell - 1) / cell);
+    map[INSPECT_CELLS] = '\0';
+
+    inspect_str(out, "{\"addr\": \"0x");
+    inspect_num(out, (size_t) first->addr, 16);
+    inspect_str(out, "\", ");
+    inspect_field(out, "size", first->mmap_size);
+    inspect_str(out, ", ");
+    inspect_field(out, "source", (size_t) first->source);
+    inspect_str(out, ", ");
+    inspect_field(out, "blocks", blocks);
+    inspect_str(out, ", ");
+    inspect_field(out, "used_bytes", used);
+    inspect_str(out, ", ");
+    inspect_field(out, "free_blocks", free_blocks);
+    inspect_str(out, ", ");
+    inspect_field(out, "free_bytes", free_bytes);
+    inspect_str(out, ", ");
+    inspect_field(out, "purged_bytes", purged);
+    inspect_str(out, ", ");
+    inspect_field(out, "largest_free", largest);
+    inspect_str(out, ", \"map\": \"");
+    inspect_str(out, map);
+    inspect_str(out, "\"}");
+}
+
+void __inspect_impl(void (*emit)(const char *, size_t, void *), void *arg) {
+    inspect_t out;
+    block_t *cur;
+    size_t count[INSPECT_BUCKETS], bytes[INSPECT_BUCKETS];
+    size_t free_bytes, free_blocks, largest, remote, i, b;
+    int first;
+
+    out.emit = emit;
+    out.arg = arg;
+    out.len = 0;
+
+    __memset(count, 0, sizeof(count));
+    __memset(bytes, 0, sizeof(bytes));
+    free_bytes = free_blocks = largest = 0;
+    for (cur = head; cur != NULL; cur = cur->next){
+        if (!cur->free)
+            continue;
+        free_blocks++;
+        free_bytes += cur->length;
+        if (cur->length > largest)
+            largest = cur->length;
+        for (b = 0; b + 1 < INSPECT_BUCKETS && (cur->length >> (b + 1)) != 0; b++);
+        count[b]++;
+        bytes[b] += cur->length;
+    }
+    // the queue only grows at its head while we hold the lock
+    remote = 0;
+    for (cur = __atomic_load_n(&remote_frees, __ATOMIC_ACQUIRE); cur != NULL; 
+         cur = *((block_t **) (((void *) cur) + MEM_SIZE)))
+        remote++;
+
+    inspect_str(&out, "{");
+    inspect_field(&out, "mapped_bytes", mapped_bytes);
+    inspect_str(&out, ", ");
+    inspect_field(&out, "purged_bytes", purged_bytes);
+    inspect_str(&out, ", ");
+    inspect_field(&out, "remote_frees", remote);
+    inspect_str(&out, ", ");
+    inspect_field(&out, "quick_bytes", quick_bytes);
+    inspect_str(&out, ", ");
+    inspect_field(&out, "free_bytes", free_bytes);
+    inspect_str(&out, ", ");
+    inspect_field(&out, "free_blocks", free_blocks);
+    inspect_str(&out, ", ");
+    inspect_field(&out, "largest_free", largest);
+    inspect_str(&out, ", ");
+    inspect_field(&out, "fragmentation", 
+                  (free_bytes == 0) ? 0 : 1000 - (largest * 1000) / free_bytes);
+    inspect_str(&out, ",\n \"histogram\": [");
+    first = 1;
+    for (i = 0; i < INSPECT_BUCKETS; i++){
+        if (count[i] == 0)
+            continue;
+        inspect_str(&out, first ? "{" : ", {");
+        first = 0;
+        inspect_field(&out, "min", ((size_t) 1) << i);
+        inspect_str(&out, ", ");
+        inspect_field(&out, "count", count[i]);
+        inspect_str(&out, ", ");
+        inspect_field(&out, "bytes", bytes[i]);
+        inspect_str(&out, "}");
+    }
+    inspect_str(&out, "],\n \"chunks\": [");
+    first = 1;
+    for (cur = head; cur != NULL; ){
+        inspect_str(&out, first ? "\n  " : ",\n  ");
+        first = 0;
+        inspect_chunk(&out, cur);
+        for (b = (size_t) cur->addr; cur != NULL && (size_t) cur->addr == b; cur = cur->next);
+    }
+    inspect_str(&out, "]}\n");
+    inspect_flush(&out);
+}
+
+/* Size classes of the per-CPU caches
+
+   memory.c caches freed small blocks per CPU and hands them out again
+   without taking the lock; for the heap, they stay allocated. A block
+   serves every request that needs the same length, so the class of a
+   request and of a block is just its length in ALIGNMENT steps above 
+   MIN_BLOCK. (size_t) -1 means that the request or block must take 
+   the locked path: the caches are disabled, the request is too large
+   or the block is inherited memory, which must not be reused. The 
+   caller compares the class with the number of classes it caches.
+
+*/
+size_t __size_class_impl(size_t size) {
+    if (size - 1 < cache_max_size) // no branch for 0
+        return size_class(size);
+    return (size_t) -1;
+}
+
+size_t __block_class_impl(void *ptr) {
+    if (!cache_enabled || ptr == NULL)
+        return (size_t) -1;
+    return block_class((block_t *) (ptr - MEM_SIZE));
+}
+
+int __cache_enabled_impl(void) {
+    return cache_enabled;
+}
+
+size_t __cache_budget_impl(void) {
+    return cache_budget;
+}
+
+size_t __cache_decay_impl(void) {
+    return cache_decay;
+}
+
+/* largest request that blocks of class serve */
+size_t __class_size_impl(size_t class) {
+    return MIN_BLOCK + class * ALIGNMENT - MEM_SIZE;
+}
+
+/* Sets the soft limit (0 for none) and the hook called under memory
+   pressure (NULL for none). The hook gets the number of bytes missing
+   and may release the lock while it runs. */
+void __set_limit_impl(size_t limit) {
+    heap_limit = limit;
+}
+
+void __set_pressure_hook_impl(void (*hook)(size_t)) {
+    pressure_hook = hook;
+}
+
+void __set_cache_flush_hook_impl(void (*hook)(void)) {
+    cache_flush_hook = hook;
+}
+
+void __heap_usage_impl(size_t *mapped, size_t *purged) {
+    *mapped = mapped_bytes;
+    *purged = purged_bytes;
+}
+
+/* Runtime configuration
+
+   conf is a comma separated list of key:value pairs, e.g.
+
+   chunk:4M,large:512K
+
+   Sizes are given in bytes, optionally followed by K, M or G. The keys
+   are:
+
+   chunk   size of the chunks mapped for the heap (default 16M)
+   large   requests of this size or more get a mapping of their own
+           (default 4M)
+   thp     off, on or hugetlb: huge page backing of chunks and large
+           mappings (default off)
+   populate  off or on: prefault every new mapping (default off)
+   reserve   size of a prefaulted chunk mapped at startup and never 
+             unmapped (default 0, no reserve)
+   limit   soft limit on the memory of the heap (default 0, no limit)
+   cache   on, off or the size of the per-CPU caches of small blocks 
+           in memory.c, which grow up to it in total (default 8M)
+   decay   off or the number of refills and flushes of the per-CPU 
+           caches after which their idle stacks are halved (default 256)
+   cacheline  on or off: blocks of 64 bytes or more on whole cache 
+              lines (default on)
+   defer   on or off: deferred coalescing through quick lists 
+           (default off)
+
+   Pairs with an unknown key or an invalid value are ignored and 
+   handed to reject, which reports them. The parser does not allocate;
+   it is run once, before the first chunk is mapped if possible, as a 
+   changed chunk size does not apply to existing chunks.
+
+*/
+static int conf_key(const char **conf, const char *key){
+    const char *c;
+    for (c = *conf; *key != '\0'; c++, key++){
+        if (*c != *key)
+            return 0;
+    }
+    if (*c != ':')
+        return 0;
+    *conf = c + 1;
+    return 1;
+}
+
+static int conf_size(const char **conf, size_t *value){
+    const char *c;
+    size_t v, shift;
+
+    c = *conf;
+    if (*c < '0' || *c > '9')
+        return 0;
+    for (v = 0; *c >= '0' && *c <= '9'; c++){
+        if (v > (((size_t) -1) - ((size_t) (*c - '0'))) / ((size_t) 10))
+            return 0; // overflow
+        v = v * ((size_t) 10) + ((size_t) (*c - '0'));
+    }
+    shift = 0;
+    switch (*c){
+        case 'k': case 'K': shift = 10; c++; break;
+        case 'm': case 'M': shift = 20; c++; break;
+        case 'g': case 'G': shift = 30; c++; break;
+    }
+    if (((v << shift) >> shift) != v)
+        return 0; // overflow
+    if (*c != ',' && *c != '\0')
+        return 0;
+    *value = v << shift;
+    *conf = c;
+    return 1;
+}
+
+static int conf_word(const char **conf, const char *word){
+    const char *c;
+    for (c = *conf; *word != '\0'; c++, word++){
+        if (*c != *word)
+            return 0;
+    }
+    if (*c != ',' && *c != '\0')
+        return 0;
+    *conf = c;
+    return 1;
+}
+
+void __configure_impl(const char *conf, 
+        void (*reject)(const char *, size_t, void *), void *arg) {
+    const char *pair;
+    size_t v;
+
+    if (conf == NULL) return;
+    while (*conf != '\0'){
+        pair = conf;
+        if (conf_key(&conf, "chunk")){
+            if (conf_size(&conf, &v) && v >= PAGE_SIZE)
+                chunk_size = ALIGN_UP(v, PAGE_SIZE);
+            else
+                conf = pair; // out of range
+        }
+        else if (conf_key(&conf, "large")){
+            if (conf_size(&conf, &v) && v > ((size_t) 0))
+                large_threshold = v;
+            else
+                conf = pair;
+        }
+        else if (conf_key(&conf, "thp")){
+            if (conf_word(&conf, "off"))
+                thp_mode = THP_OFF;
+            else if (conf_word(&conf, "on"))
+                thp_mode = THP_ON;
+            else if (conf_word(&conf, "hugetlb"))
+                thp_mode = THP_HUGETLB;
+        }
+        else if (conf_key(&conf, "populate")){
+            if (conf_word(&conf, "off"))
+                populate = 0;
+            else if (conf_word(&conf, "on"))
+                populate = 1;
+        }
+        else if (conf_key(&conf, "reserve")){
+            if (conf_size(&conf, &v))
+                reserve_size = v;
+        }
+        else if (conf_key(&conf, "defer")){
+            if (conf_word(&conf, "off"))
+                defer_mode = 0;
+            else if (conf_word(&conf, "on"))
+                defer_mode = 1;
+        }
+        else if (conf_key(&conf, "cacheline")){
+            if (conf_word(&conf, "off"))
+                cacheline_mode = 0;
+            else if (conf_word(&conf, "on"))
+                cacheline_mode = 1;
+        }
+        else if (conf_key(&conf, "cache")){
+            if (conf_word(&conf, "off"))
+                cache_enabled = 0;
+            else if (conf_word(&conf, "on"))
+                cache_enabled = 1;
+            else if (conf_size(&conf, &v)){
+                cache_budget = v;
+                cache_enabled = (v != 0);
+            }
+        }
+        else if (conf_key(&conf, "decay")){
+            if (conf_word(&conf, "off"))
+                cache_decay = 0;
+            else if (conf_size(&conf, &v))
+                cache_decay = v;
+        }
+        else if (conf_key(&conf, "limit")){
+            if (conf_size(&conf, &v))
+                heap_limit = v;
+        }
+        // a known key with a valid value leaves conf at the end of the pair
+        if ((*conf != ',' && *conf != '\0') || (conf != pair && conf[-1] == ':')){
+            while (*conf != ',' && *conf != '\0') // skip to the next pair
+                conf++;
+            reject(pair, (size_t) (conf - pair), arg);
+        }
+        if (*conf == ',')
+            conf++;
+    }
+
+    // all keys are known now, e.g. whether the reserve goes on huge pages
+    reserve_memory(reserve_size);
+    cache_max_size = 0;
+    if (cache_enabled)
+        cache_max_size = (large_threshold - 1 < CLASS_MAX_SIZE) ? large_threshold - 1 : CLASS_MAX_SIZE;
+}
+
+/* Called by the fork handlers with the memory management lock held.
+
+   Before the fork, the remote free queue is emptied so the child
+   does not start with blocks queued by threads it does not have.
+
+   In the child, in copy-on-write mode (cow non-zero), all memory
+   allocated so far stays where it is but is no longer used for new
+   allocations nor written to when freed. The parent's heap pages are
+   hence never touched by the child and remain shared.
+
+*/
+void __fork_prepare_impl(void) {
+    drain_remote_frees();
+}
+
+void __fork_child_impl(int cow) {
+    if (cow)
+        inherit_blocks();
+}
+
 /* End of the actual malloc/calloc/realloc/free functions */
@@ -74,27 +74,559 @@
 
 */
 
+#define _GNU_SOURCE /* for mremap */
+
 #include <stddef.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <pthread.h>
-
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <signal.h>
+#if defined(__x86_64__) && defined(__has_include)
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define MEMORY_HAVE_RSEQ
+#endif
+#endif
+#include "memory.h"
 
 void *__malloc_impl(size_t);
 void *__calloc_impl(size_t, size_t);
 void *__realloc_impl(void *, size_t);
 void __free_impl(void *);
+void __free_remote_impl(void *);
+void *__memalign_impl(size_t, size_t);
+size_t __malloc_batch_impl(size_t, void **, size_t);
+void *__malloc_cacheline_impl(size_t);
+region_t *__region_create_impl(void);
+void *__region_alloc_impl(region_t *, size_t);
+void *__region_refill_impl(region_t *, size_t);
+void __region_destroy_impl(region_t *);
+size_t __purge_impl(size_t, size_t);
+size_t __region_purge_impl(region_t *, size_t);
+void __set_limit_impl(size_t);
+void __set_pressure_hook_impl(void (*)(size_t));
+void __set_cache_flush_hook_impl(void (*)(void));
+void __heap_usage_impl(size_t *, size_t *);
+void __inspect_impl(void (*)(const char *, size_t, void *), void *);
+size_t __size_class_impl(size_t);
+size_t __block_class_impl(void *);
+int __cache_enabled_impl(void);
+size_t __cache_budget_impl(void);
+size_t __cache_decay_impl(void);
+size_t __class_size_impl(size_t);
+void __configure_impl(const char *, void (*)(const char *, size_t, void *), void *);
+int __set_chunk_hooks_impl(void *(*)(size_t, void *),
+			   int (*)(void *, size_t, void *), void *, size_t);
+int __pheap_open_impl(void *, size_t);
+void __pheap_close_impl(void *);
+void *__pmalloc_impl(void *, size_t);
+void __pfree_impl(void *, void *);
+void *__pheap_root_impl(void *);
+void __pheap_set_root_impl(void *, void *);
+void __fork_prepare_impl(void);
+void __fork_child_impl(int);
 
 static int __memory_print_debug_running = 0;
 static int __memory_print_debug_init_running = 0;
 static int __memory_print_debug_initialized = 0;
 static int __memory_print_debug_do_it = 0;
 
-static pthread_mutex_t memory_management_lock = PTHREAD_MUTEX_INITIALIZER;
+/* A lock built directly on the futex system call.
+
+   state is 0 when the lock is free, 1 when it is held and 2 when it
+   is held and some thread may sleep on it. Taking a free lock and
+   releasing a lock nobody waits for is a single atomic instruction;
+   the kernel is only entered when a thread really has to sleep or
+   has to be woken up. A contended thread first spins for a short,
+   bounded time as the critical sections of the allocator are short.
+
+   The counters are only written by the thread that holds the lock,
+   so they need no atomic operations of their own.
+
+*/
+typedef struct memory_lock {
+  int state;
+  unsigned long long acquisitions;
+  unsigned long long contended;
+  unsigned long long wait_ns;
+} memory_lock_t;
+
+#define MEMORY_LOCK_INITIALIZER { 0, 0, 0, 0 }
+#define MEMORY_LOCK_SPIN        100
+
+static memory_lock_t memory_management_lock = MEMORY_LOCK_INITIALIZER;
 static pthread_mutex_t print_lock = PTHREAD_MUTEX_INITIALIZER;
 
+static inline void __memory_cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  __asm__ __volatile__ ("yield");
+#endif
+}
+
+static unsigned long long __memory_now_ns() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((unsigned long long) ts.tv_sec) * 1000000000ull +
+    ((unsigned long long) ts.tv_nsec);
+}
+
+static int __memory_trylock(memory_lock_t *lock) {
+  int c = 0;
+
+  if (!__atomic_compare_exchange_n(&lock->state, &c, 1, 0,
+				   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    return 0;
+  lock->acquisitions++;
+  return 1;
+}
+
+static void __memory_lock(memory_lock_t *lock) {
+  unsigned long long start;
+  int c, i;
+
+  if (__memory_trylock(lock)) return;
+
+  start = __memory_now_ns();
+  c = 1;
+  for (i=0; i<MEMORY_LOCK_SPIN; i++) {
+    __memory_cpu_relax();
+    c = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+    if (c == 0) {
+      if (__atomic_compare_exchange_n(&lock->state, &c, 1, 0,
+				      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+	goto acquired;
+    }
+    if (c == 2) break;
+  }
+
+  /* Announce that we are going to sleep, then sleep until the lock
+     is released. We never know whether other sleepers remain, so
+     the lock is retaken in state 2 and the unlock will wake one. */
+  c = __atomic_exchange_n(&lock->state, 2, __ATOMIC_ACQUIRE);
+  while (c != 0) {
+    syscall(SYS_futex, &lock->state, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+    c = __atomic_exchange_n(&lock->state, 2, __ATOMIC_ACQUIRE);
+  }
+
+ acquired:
+  lock->acquisitions++;
+  lock->contended++;
+  lock->wait_ns += __memory_now_ns() - start;
+}
+
+static void __memory_unlock(memory_lock_t *lock) {
+  if (__atomic_exchange_n(&lock->state, 0, __ATOMIC_RELEASE) == 2) {
+    syscall(SYS_futex, &lock->state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+  }
+}
+
+/* Per-CPU caches
+
+   Small blocks that are freed go into a cache of the CPU the thread
+   runs on, one stack per size class, and malloc takes them from there
+   again; neither takes the lock. The caches are bounded per CPU, so
+   they hold memory in proportion to the number of cores, not threads.
+   An empty stack is refilled with a batch of blocks taken with a 
+   single lock, a full one gives half of its blocks back the same way.
+
+   The capacity of each stack adapts to its use: it doubles each time
+   the stack runs empty or full, up to MEMORY_CACHE_SLOTS, as long as
+   the capacities of all stacks stay within the budget (the cache key
+   of MEMORY_CONF), so that busy classes refill rarely. Every 
+   __memory_cache_period refills and flushes (the decay key, 256 by 
+   default), the stacks of the current CPU that served no request 
+   since the last time are halved and give their surplus back, so that
+   blocks do not sit unused in cold classes. Only the owning CPU trims
+   a stack; one that stops allocating keeps its blocks.
+
+   A purge empties the stacks of the CPU it runs on and asks the other
+   CPUs to empty theirs: each CPU has a drain flag, which it checks on
+   its next cached malloc or free, before touching its stacks.
+
+   A push or pop runs as a restartable sequence (rseq): glibc registers
+   each thread with the kernel, which publishes the current CPU in the
+   thread's struct rseq and, if the thread is preempted, migrated or
+   signalled inside the sequence, restarts it at the abort label. The
+   sequence hence sees the stack of its CPU alone and commits with a 
+   single store of the count. Without rseq (other architectures, old 
+   glibc, or rseq registration disabled) all requests take the lock.
+
+*/
+/* MEMORY_CACHE_CLASSES (memory.h): blocks for requests up to 256 bytes */
+#define MEMORY_CACHE_SLOTS   128 /* largest capacity of a stack */
+#define MEMORY_CACHE_MIN     4   /* smallest */
+#define MEMORY_CACHE_START   16  /* initial */
+
+/* The layout up to slots is known to the rseq sequences below. */
+typedef struct memory_cache_bin {
+  size_t count;
+  size_t limit;                  /* capacity */
+  unsigned long long hits;       /* pops that found a block */
+  unsigned long long seen;       /* hits at the last decay, under the lock */
+  void *slots[MEMORY_CACHE_SLOTS];
+} memory_cache_bin_t;
+
+typedef struct memory_cpu_cache {
+  memory_cache_bin_t bins[MEMORY_CACHE_CLASSES];
+  int drain;                     /* a purge asked for the stacks */
+} __attribute__((aligned(64))) memory_cpu_cache_t;
+
+/* Counters of the locked paths, protected by memory_management_lock */
+typedef struct memory_cache_class {
+  unsigned long long misses;     /* refills of an empty stack */
+  unsigned long long flushes;    /* flushes of a full stack */
+} memory_cache_class_t;
+
+static memory_cpu_cache_t *__memory_caches = NULL;
+static unsigned int __memory_cache_cpus = 0;
+static memory_cache_class_t __memory_cache_classes[MEMORY_CACHE_CLASSES];
+static size_t __memory_cache_capacity = 0; /* bytes, under the lock */
+static size_t __memory_cache_budget = 0;
+static unsigned int __memory_cache_ops = 0;
+static size_t __memory_cache_period = 0;  /* decay key of MEMORY_CONF, 0 for none */
+
+#ifdef MEMORY_HAVE_RSEQ
+static inline struct rseq *__memory_rseq() {
+  return (struct rseq *) (((char *) __builtin_thread_pointer()) + __rseq_offset);
+}
+
+static inline unsigned int __memory_cache_cpu() {
+  return __atomic_load_n(&__memory_rseq()->cpu_id, __ATOMIC_RELAXED);
+}
+
+/* Pops from the stack of cpu, which must be the CPU the thread runs
+   on: returns 1 on success, 0 if the stack was empty and -1 if the 
+   thread is on another CPU or the sequence was interrupted. Labels 1 
+   to 2 are the critical section, described by the rseq_cs at label 3;
+   the kernel checks the signature in front of the abort handler at 
+   label 4. A pop counts a hit before its commit, so a restarted pop 
+   may count twice. */
+static int __memory_cache_pop_on(unsigned int cpu, size_t class, void **ptr) {
+  struct rseq *rs = __memory_rseq();
+  memory_cache_bin_t *bin;
+
+  bin = &__memory_caches[cpu].bins[class];
+  __asm__ __volatile__ goto (
+    ".pushsection __rseq_cs, \"aw\"\n\t"
+    ".balign 32\n\t"
+    "3:\n\t"
+    ".long 0x0, 0x0\n\t"
+    ".quad 1f, (2f - 1f), 4f\n\t"
+    ".popsection\n\t"
+    "leaq 3b(%%rip), %%rax\n\t"
+    "movq %%rax, %[rseq_cs]\n\t"
+    "1:\n\t"
+    "cmpl %[cpu], %[cpu_id]\n\t"
+    "jnz %l[abort]\n\t"
+    "movq (%[bin]), %%rcx\n\t"
+    "testq %%rcx, %%rcx\n\t"
+    "jz %l[empty]\n\t"
+    "movq 24(%[bin], %%rcx, 8), %%rax\n\t"
+    "movq %%rax, (%[ptr])\n\t"
+    "incq 16(%[bin])\n\t"
+    "decq %%rcx\n\t"
+    "movq %%rcx, (%[bin])\n\t" /* commit */
+    "2:\n\t"
+    ".pushsection __rseq_failure, \"ax\"\n\t"
+    ".byte 0x0f, 0xb9, 0x3d\n\t"
+    ".long 0x53053053\n\t" /* RSEQ_SIG */
+    "4:\n\t"
+    "jmp %l[abort]\n\t"
+    ".popsection\n\t"
+    : /* no outputs */
+    : [cpu] "r" (cpu), [cpu_id] "m" (rs->cpu_id), [rseq_cs] "m" (rs->rseq_cs),
+      [bin] "r" (bin), [ptr] "r" (ptr)
+    : "memory", "cc", "rax", "rcx"
+    : abort, empty);
+  return 1;
+ abort:
+  return -1;
+ empty:
+  return 0;
+}
+
+/* Both return 1 on success and 0 if the stack of the current CPU was
+   empty or full. */
+static int __memory_cache_pop(size_t class, void **ptr) {
+  unsigned int cpu;
+  int res;
+
+  do {
+    cpu = __memory_cache_cpu();
+    if (cpu >= __memory_cache_cpus) return 0;
+    res = __memory_cache_pop_on(cpu, class, ptr);
+  } while (res < 0);
+  return res;
+}
+
+static int __memory_cache_push(size_t class, void *ptr) {
+  struct rseq *rs = __memory_rseq();
+  memory_cache_bin_t *bin;
+  unsigned int cpu;
+
+ retry:
+  cpu = __atomic_load_n(&rs->cpu_id, __ATOMIC_RELAXED);
+  if (cpu >= __memory_cache_cpus) return 0;
+  bin = &__memory_caches[cpu].bins[class];
+  __asm__ __volatile__ goto (
+    ".pushsection __rseq_cs, \"aw\"\n\t"
+    ".balign 32\n\t"
+    "3:\n\t"
+    ".long 0x0, 0x0\n\t"
+    ".quad 1f, (2f - 1f), 4f\n\t"
+    ".popsection\n\t"
+    "leaq 3b(%%rip), %%rax\n\t"
+    "movq %%rax, %[rseq_cs]\n\t"
+    "1:\n\t"
+    "cmpl %[cpu], %[cpu_id]\n\t"
+    "jnz %l[abort]\n\t"
+    "movq (%[bin]), %%rcx\n\t"
+    "cmpq 8(%[bin]), %%rcx\n\t"
+    "jae %l[full]\n\t"
+    "movq %[ptr], 32(%[bin], %%rcx, 8)\n\t"
+    "incq %%rcx\n\t"
+    "movq %%rcx, (%[bin])\n\t" /* commit */
+    "2:\n\t"
+    ".pushsection __rseq_failure, \"ax\"\n\t"
+    ".byte 0x0f, 0xb9, 0x3d\n\t"
+    ".long 0x53053053\n\t" /* RSEQ_SIG */
+    "4:\n\t"
+    "jmp %l[abort]\n\t"
+    ".popsection\n\t"
+    : /* no outputs */
+    : [cpu] "r" (cpu), [cpu_id] "m" (rs->cpu_id), [rseq_cs] "m" (rs->rseq_cs),
+      [bin] "r" (bin), [ptr] "r" (ptr)
+    : "memory", "cc", "rax", "rcx"
+    : abort, full);
+  return 1;
+ abort:
+  goto retry;
+ full:
+  return 0;
+}
+#else
+static inline unsigned int __memory_cache_cpu() {
+  return 0;
+}
+
+static int __memory_cache_pop_on(unsigned int cpu, size_t class, void **ptr) {
+  return 0;
+}
+
+static int __memory_cache_pop(size_t class, void **ptr) {
+  return 0;
+}
+
+static int __memory_cache_push(size_t class, void *ptr) {
+  return 0;
+}
+#endif
+
+/* Empties all stacks and gives them their initial capacity. */
+static void __memory_cache_reset(unsigned int cpus) {
+  unsigned int cpu;
+  size_t class;
+
+  memset(__memory_caches, 0, ((size_t) cpus) * sizeof(memory_cpu_cache_t));
+  memset(__memory_cache_classes, 0, sizeof(__memory_cache_classes));
+  __memory_cache_capacity = 0;
+  for (cpu=0; cpu<cpus; cpu++) {
+    for (class=0; class<MEMORY_CACHE_CLASSES; class++) {
+      __memory_caches[cpu].bins[class].limit = MEMORY_CACHE_START;
+      __memory_cache_capacity += MEMORY_CACHE_START * __class_size_impl(class);
+    }
+  }
+}
+
+/* Gives the blocks of all stacks of cpu, the CPU the thread runs on,
+   back to the heap. If the thread leaves cpu meanwhile, the drain flag
+   stays set and the rest is given back on the next call on cpu. The 
+   pops are not counted as hits. Must be called with the lock held. */
+static void __memory_cache_drain(unsigned int cpu) {
+  memory_cache_bin_t *bin;
+  size_t class;
+  void *ptr;
+  int res;
+
+  __atomic_store_n(&__memory_caches[cpu].drain, 0, __ATOMIC_RELAXED);
+  for (class=0; class<MEMORY_CACHE_CLASSES; class++) {
+    bin = &__memory_caches[cpu].bins[class];
+    while ((res = __memory_cache_pop_on(cpu, class, &ptr)) > 0) {
+      __atomic_fetch_sub(&bin->hits, 1, __ATOMIC_RELAXED);
+      __free_impl(ptr);
+    }
+    if (res < 0) {
+      __atomic_store_n(&__memory_caches[cpu].drain, 1, __ATOMIC_RELAXED);
+      return;
+    }
+  }
+}
+
+#ifdef MEMORY_HAVE_RSEQ
+/* Empties the stacks before a purge (malloc_trim, memory_purge or the
+   soft limit), so that it can release their pages: those of the 
+   current CPU at once, those of the other CPUs, which only they may 
+   pop, when they next use their caches. Must be called with the lock
+   held. */
+static void __memory_cache_flush() {
+  unsigned int cpu;
+
+  for (cpu=0; cpu<__memory_cache_cpus; cpu++) {
+    __atomic_store_n(&__memory_caches[cpu].drain, 1, __ATOMIC_RELAXED);
+  }
+  cpu = __memory_cache_cpu();
+  if (cpu < __memory_cache_cpus) __memory_cache_drain(cpu);
+}
+#endif
+
+/* Honours a drain request for the current CPU, outside the lock. */
+static inline void __memory_cache_check_drain() {
+  unsigned int cpu;
+
+  cpu = __memory_cache_cpu();
+  if (cpu >= __memory_cache_cpus) return;
+  if (__builtin_expect(__atomic_load_n(&__memory_caches[cpu].drain, __ATOMIC_RELAXED), 0)) {
+    __memory_lock(&memory_management_lock);
+    __memory_cache_drain(cpu);
+    __memory_unlock(&memory_management_lock);
+  }
+}
+
+/* Maps the caches once the configuration is known, if the thread
+   running the constructor is registered for rseq. */
+static void __memory_cache_init() {
+#ifdef MEMORY_HAVE_RSEQ
+  long cpus;
+  void *caches;
+
+  if ((__rseq_size == 0) || !__cache_enabled_impl()) return;
+  if (__memory_rseq()->cpu_id >= (unsigned int) RSEQ_CPU_ID_REGISTRATION_FAILED) return;
+  cpus = sysconf(_SC_NPROCESSORS_CONF);
+  if (cpus <= 0) return;
+  caches = mmap(NULL, ((size_t) cpus) * sizeof(memory_cpu_cache_t), PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (caches == MAP_FAILED) return;
+  __memory_caches = caches;
+  __memory_cache_budget = __cache_budget_impl();
+  __memory_cache_period = __cache_decay_impl();
+  __memory_cache_reset((unsigned int) cpus);
+  __atomic_store_n(&__memory_cache_cpus, (unsigned int) cpus, __ATOMIC_RELEASE);
+  __set_cache_flush_hook_impl(__memory_cache_flush);
+#endif
+}
+
+/* Grows the stack of class on the current CPU, which ran empty or
+   full, if the budget allows, and decays the idle stacks of the CPU
+   every __memory_cache_period calls. Returns the capacity of the stack.
+   Must be called with the lock held. */
+static size_t __memory_cache_adapt(size_t class) {
+  memory_cache_bin_t *bins, *bin;
+  unsigned long long hits;
+  unsigned int cpu;
+  size_t c, limit, bytes, n;
+  void *ptr;
+
+  cpu = __memory_cache_cpu();
+  if (cpu >= __memory_cache_cpus) return MEMORY_CACHE_MIN;
+  bins = __memory_caches[cpu].bins;
+  limit = bins[class].limit;
+  bytes = limit * __class_size_impl(class);
+  if ((limit < MEMORY_CACHE_SLOTS) && (__memory_cache_capacity + bytes <= __memory_cache_budget)) {
+    __memory_cache_capacity += bytes;
+    limit *= 2;
+    __atomic_store_n(&bins[class].limit, limit, __ATOMIC_RELAXED);
+  }
+  if ((__memory_cache_period == 0) || ((++__memory_cache_ops % __memory_cache_period) != 0)) return limit;
+
+  for (c=0; c<MEMORY_CACHE_CLASSES; c++) {
+    bin = &bins[c];
+    hits = __atomic_load_n(&bin->hits, __ATOMIC_RELAXED);
+    if ((hits == bin->seen) && (c != class) && (bin->limit > MEMORY_CACHE_MIN)) {
+      __atomic_store_n(&bin->limit, bin->limit / 2, __ATOMIC_RELAXED);
+      __memory_cache_capacity -= bin->limit * __class_size_impl(c);
+      /* the surplus is popped while the thread is still on cpu; 
+	 otherwise cpu finds the stack full on its next push */
+      n = __atomic_load_n(&bin->count, __ATOMIC_RELAXED);
+      for (; (n > bin->limit) && (__memory_cache_pop_on(cpu, c, &ptr) > 0); n--) {
+	__free_impl(ptr);
+      }
+      hits = __atomic_load_n(&bin->hits, __ATOMIC_RELAXED);
+    }
+    bin->seen = hits;
+  }
+  return limit;
+}
+
+/* Returns a block from the cache of the current CPU, refilling it if
+   needed, or NULL if the request must take the locked path. */
+static void *__memory_cache_malloc(size_t size) {
+  void *ptr, *batch[MEMORY_CACHE_SLOTS / 2];
+  size_t class, n, i;
+
+  if (__atomic_load_n(&__memory_cache_cpus, __ATOMIC_ACQUIRE) == 0) return NULL;
+  class = __size_class_impl(size);
+  if (class >= MEMORY_CACHE_CLASSES) return NULL;
+  __memory_cache_check_drain();
+  if (__memory_cache_pop(class, &ptr)) return ptr;
+
+  __memory_lock(&memory_management_lock);
+  __memory_cache_classes[class].misses++;
+  n = __memory_cache_adapt(class) / 2;
+  n = __malloc_batch_impl(size, batch, n);
+  __memory_unlock(&memory_management_lock);
+  if (n == ((size_t) 0)) return NULL;
+  for (i=1; i<n; i++) {
+    if (!__memory_cache_push(class, batch[i])) break;
+  }
+  if (i < n) { /* the thread moved to a CPU with a full cache */
+    __memory_lock(&memory_management_lock);
+    for (; i<n; i++) {
+      __free_impl(batch[i]);
+    }
+    __memory_unlock(&memory_management_lock);
+  }
+  return batch[0];
+}
+
+/* Puts ptr into the cache of the current CPU, making room if needed.
+   Returns 0 if the block must take the locked path. */
+static int __memory_cache_free(void *ptr) {
+  void *old;
+  size_t class, n, limit;
+
+  if (__atomic_load_n(&__memory_cache_cpus, __ATOMIC_ACQUIRE) == 0) return 0;
+  class = __block_class_impl(ptr);
+  if (class >= MEMORY_CACHE_CLASSES) return 0;
+  __memory_cache_check_drain();
+  if (__memory_cache_push(class, ptr)) return 1;
+
+  __memory_lock(&memory_management_lock);
+  __memory_cache_classes[class].flushes++;
+  limit = __memory_cache_adapt(class);
+  if (!__memory_cache_push(class, ptr)) {
+    for (n=0; (n < limit / 2) && __memory_cache_pop(class, &old); n++) {
+      __free_impl(old);
+    }
+    if (!__memory_cache_push(class, ptr)) __free_impl(ptr);
+  }
+  __memory_unlock(&memory_management_lock);
+  return 1;
+}
+
 static void __memory_print_debug_init() {
   char *env_var;
   
@@ -113,6 +645,388 @@ static void __memory_print_debug_init() {
   __memory_print_debug_init_running = 0;
 }
 
+/* fork() safety
+
+   A fork while another thread is inside malloc would leave the child
+   with a lock that is never released. The handlers below take both
+   locks before the fork so that the allocator is quiescent, and release
+   them on both sides afterwards.
+
+   If MEMORY_FORK_COW is set to yes, the child additionally stops
+   writing into any memory it inherited, see __fork_child_impl. This is
+   meant for pre-forking servers that warm up and then fork workers:
+   the workers keep sharing the parent's heap pages instead of
+   silently copying every page on which a block header is written.
+
+*/
+static int __memory_fork_cow = 0;
+
+static int __memory_file_active = 0;
+static void __memory_file_snapshot();
+static void __memory_file_drop_snapshot();
+static void __memory_file_privatize();
+
+static void __memory_fork_prepare() {
+  __memory_lock(&memory_management_lock);
+  pthread_mutex_lock(&print_lock);
+  __fork_prepare_impl();
+  if (__memory_file_active) {
+    __memory_file_snapshot();
+  }
+}
+
+static void __memory_fork_parent() {
+  __memory_file_drop_snapshot();
+  pthread_mutex_unlock(&print_lock);
+  __memory_unlock(&memory_management_lock);
+}
+
+static void __memory_fork_child() {
+  __fork_child_impl(__memory_fork_cow);
+  /* The cached blocks are inherited memory, which a child in 
+     copy-on-write mode must not reuse. */
+  if (__memory_fork_cow && (__memory_caches != NULL)) {
+    __memory_cache_reset(__memory_cache_cpus);
+  }
+  /* The chunk file is shared with the parent: the child gets a private
+     copy of the chunks it inherited and must not take new chunks out 
+     of the file, which the parent believes to be free. */
+  if (__memory_file_active) {
+    __memory_file_privatize();
+    __set_chunk_hooks_impl(NULL, NULL, NULL, 0);
+    __memory_file_active = 0;
+  }
+  pthread_mutex_init(&print_lock, NULL);
+  memory_management_lock.state = 0;
+}
+
+/* Runtime configuration
+
+   MEMORY_CONF holds a comma separated list of key:value pairs that 
+   tune the allocator for a process without recompiling memory.so, e.g.
+
+   export MEMORY_CONF=chunk:4M,large:1M
+
+   See __configure_impl for the keys. Pairs it cannot use are reported
+   on stderr and otherwise ignored.
+
+*/
+static void __memory_conf_reject(const char *pair, size_t len, void *arg) {
+  static const char prefix[] = "memory.so: MEMORY_CONF: ignoring ";
+  char buf[128];
+  size_t n;
+  ssize_t res;
+
+  (void) arg;
+  n = sizeof(prefix) - ((size_t) 1);
+  memcpy(buf, prefix, n);
+  if (len > sizeof(buf) - n - ((size_t) 1)) len = sizeof(buf) - n - ((size_t) 1);
+  memcpy(buf + n, pair, len);
+  n += len;
+  buf[n++] = '\n';
+  do {
+    res = write(STDERR_FILENO, buf, n);
+  } while ((res < 0) && (errno == EINTR));
+}
+
+static void __memory_conf_init() {
+  char *env_var;
+
+  env_var = getenv("MEMORY_CONF");
+  if (env_var != NULL) {
+    __memory_lock(&memory_management_lock);
+    __configure_impl(env_var, __memory_conf_reject, NULL);
+    __memory_unlock(&memory_management_lock);
+  }
+}
+
+/* File-backed chunks
+
+   memory_chunk_file maps a (preallocated) file once and hands out its
+   chunks through the chunk source hooks, MEMORY_FILE_UNIT bytes at a
+   time. A file on a tmpfs or hugetlbfs mount hence places the heap on
+   that mount. The used units are kept in a table in this library, as
+   the hooks must not allocate. Released chunks are punched out of the
+   file with MADV_REMOVE so that the mount gets the memory back.
+
+   When the file is exhausted, or another process uses it already (it
+   is locked with flock), the allocator falls back to anonymous
+   mappings.
+
+   The mapping is shared, but memory must not be shared with a forked
+   child. The prepare handler hence copies the used chunks into private
+   anonymous memory, with the lock held and before fork() returns in
+   the parent, so that the copy is what the heap held at the fork. The
+   child moves the copy to the addresses of the chunks and goes back to
+   anonymous mappings for new chunks; the parent unmaps it. This makes
+   fork() as expensive as copying the heap.
+
+*/
+#define MEMORY_FILE_UNIT  ((size_t) 2097152)
+#define MEMORY_FILE_UNITS ((size_t) 65536)
+
+static void *__memory_file_base = NULL;
+static size_t __memory_file_units = 0;
+static unsigned char __memory_file_used[MEMORY_FILE_UNITS];
+static int __memory_file_private = 0;
+static void *__memory_file_copy = NULL;
+static size_t __memory_file_copy_len = 0;
+
+static void *__memory_file_alloc(size_t length, void *arg) {
+  size_t n, i, run;
+
+  n = (length + (MEMORY_FILE_UNIT - ((size_t) 1))) / MEMORY_FILE_UNIT;
+  if (n == ((size_t) 0)) return NULL;
+  for (i=0, run=0; i<__memory_file_units; i++) {
+    run = __memory_file_used[i] ? 0 : run + 1;
+    if (run == n) {
+      i = i + 1 - n;
+      memset(&__memory_file_used[i], 1, n);
+      return __memory_file_base + i * MEMORY_FILE_UNIT;
+    }
+  }
+  return NULL;
+}
+
+static int __memory_file_dalloc(void *addr, size_t length, void *arg) {
+  size_t n, i;
+
+  n = (length + (MEMORY_FILE_UNIT - ((size_t) 1))) / MEMORY_FILE_UNIT;
+  i = ((size_t) (addr - __memory_file_base)) / MEMORY_FILE_UNIT;
+  if (__memory_file_private) {
+    /* a private copy made after fork */
+    if (munmap(addr, n * MEMORY_FILE_UNIT) != 0) return -1;
+  } else {
+    madvise(addr, n * MEMORY_FILE_UNIT, MADV_REMOVE);
+  }
+  memset(&__memory_file_used[i], 0, n);
+  return 0;
+}
+
+/* Copies the used units, run after run, into one private mapping. */
+static void __memory_file_snapshot() {
+  size_t i, len;
+  void *dest;
+
+  for (i=0, len=0; i<__memory_file_units; i++) {
+    if (__memory_file_used[i]) len += MEMORY_FILE_UNIT;
+  }
+  __memory_file_copy = NULL;
+  __memory_file_copy_len = len;
+  if (len == ((size_t) 0)) return;
+  dest = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (dest == MAP_FAILED) return; /* the child aborts */
+  __memory_file_copy = dest;
+  for (i=0; i<__memory_file_units; i++) {
+    if (__memory_file_used[i]) {
+      memcpy(dest, __memory_file_base + i * MEMORY_FILE_UNIT, MEMORY_FILE_UNIT);
+      dest += MEMORY_FILE_UNIT;
+    }
+  }
+}
+
+static void __memory_file_drop_snapshot() {
+  if (__memory_file_copy != NULL) {
+    munmap(__memory_file_copy, __memory_file_copy_len);
+    __memory_file_copy = NULL;
+  }
+}
+
+/* In the child: moves the snapshot over the shared chunks. */
+static void __memory_file_privatize() {
+  size_t i, n, len;
+  void *copy;
+
+  if (__memory_file_copy_len == ((size_t) 0)) {
+    __memory_file_private = 1;
+    return;
+  }
+  /* without the snapshot, the child would corrupt the parent's heap */
+  if (__memory_file_copy == NULL) abort();
+  copy = __memory_file_copy;
+  for (i=0; i<__memory_file_units; i+=n) {
+    for (n=0; (i+n<__memory_file_units) && __memory_file_used[i+n]; n++);
+    if (n == ((size_t) 0)) {
+      n = 1;
+      continue;
+    }
+    len = n * MEMORY_FILE_UNIT;
+    if (mremap(copy, len, len, MREMAP_MAYMOVE | MREMAP_FIXED,
+               __memory_file_base + i * MEMORY_FILE_UNIT) == MAP_FAILED) abort();
+    copy += len;
+  }
+  __memory_file_copy = NULL;
+  __memory_file_private = 1;
+}
+
+int memory_chunk_file(const char *path, size_t size) {
+  struct stat st;
+  void *base;
+  int fd, res;
+
+  if (__memory_file_base != NULL) return -1;
+  fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd < 0) return -1;
+  /* The lock is held as long as the descriptor is open, i.e. for the 
+     lifetime of the process, as it is never closed on success. */
+  if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+    close(fd);
+    return -1;
+  }
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return -1;
+  }
+  if (size > (size_t) st.st_size) {
+    if (ftruncate(fd, (off_t) size) != 0) {
+      close(fd);
+      return -1;
+    }
+  } else {
+    size = (size_t) st.st_size;
+  }
+  size -= size % MEMORY_FILE_UNIT;
+  if (size > MEMORY_FILE_UNITS * MEMORY_FILE_UNIT) size = MEMORY_FILE_UNITS * MEMORY_FILE_UNIT;
+  if (size == ((size_t) 0)) {
+    close(fd);
+    return -1;
+  }
+  base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED) {
+    close(fd);
+    return -1;
+  }
+
+  __memory_lock(&memory_management_lock);
+  __memory_file_base = base;
+  __memory_file_units = size / MEMORY_FILE_UNIT;
+  res = __set_chunk_hooks_impl(__memory_file_alloc, __memory_file_dalloc, NULL,
+			       MEMORY_FILE_UNIT);
+  __memory_file_active = (res > 0);
+  if (res <= 0) {
+    __memory_file_base = NULL;
+    __memory_file_units = 0;
+  }
+  __memory_unlock(&memory_management_lock);
+  if (res <= 0) {
+    munmap(base, size);
+    close(fd);
+    return -1;
+  }
+  return 0;
+}
+
+int memory_set_chunk_hooks(const memory_chunk_hooks_t *hooks) {
+  int res;
+
+  __memory_lock(&memory_management_lock);
+  if (hooks == NULL) {
+    res = __set_chunk_hooks_impl(NULL, NULL, NULL, 0);
+  } else {
+    res = __set_chunk_hooks_impl(hooks->alloc, hooks->dalloc, hooks->arg, 0);
+  }
+  __memory_file_active = 0;
+  __memory_unlock(&memory_management_lock);
+  return (res >= 0) ? 0 : -1;
+}
+
+/* Heap dumps
+
+   memory_dump writes the JSON description of the heap made by
+   __inspect_impl to a file descriptor. With MEMORY_DUMP set to a path,
+   SIGUSR2 appends such a dump to that file. The signal handler only 
+   dumps when it gets the lock right away, as the interrupted thread
+   may hold it; otherwise the dump is left to the next call to malloc
+   or free. Both paths only use write, which is async-signal-safe.
+
+*/
+static const char *__memory_dump_path = NULL;
+static int __memory_dump_pending = 0;
+
+static void __memory_dump_emit(const char *buf, size_t len, void *arg) {
+  int *fd = (int *) arg;
+  ssize_t res;
+
+  while ((len > ((size_t) 0)) && (*fd >= 0)) {
+    res = write(*fd, buf, len);
+    if (res < 0) {
+      if (errno == EINTR) continue;
+      *fd = -1; /* remember the error, drop the rest */
+      return;
+    }
+    buf += res;
+    len -= (size_t) res;
+  }
+}
+
+int memory_dump(int fd) {
+  __memory_lock(&memory_management_lock);
+  __inspect_impl(__memory_dump_emit, &fd);
+  __memory_unlock(&memory_management_lock);
+  return (fd >= 0) ? 0 : -1;
+}
+
+static void __memory_dump_to_path() {
+  int fd, saved_errno;
+
+  saved_errno = errno;
+  __atomic_store_n(&__memory_dump_pending, 0, __ATOMIC_RELAXED);
+  fd = open(__memory_dump_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+  if (fd >= 0) {
+    __inspect_impl(__memory_dump_emit, &fd);
+    if (fd >= 0) close(fd);
+  }
+  errno = saved_errno;
+}
+
+static inline void __memory_dump_deferred() {
+  if (__atomic_load_n(&__memory_dump_pending, __ATOMIC_RELAXED) &&
+      __memory_trylock(&memory_management_lock)) {
+    __memory_dump_to_path();
+    __memory_unlock(&memory_management_lock);
+  }
+}
+
+static void __memory_dump_signal(int sig) {
+  if (__memory_trylock(&memory_management_lock)) {
+    __memory_dump_to_path();
+    __memory_unlock(&memory_management_lock);
+  } else {
+    __atomic_store_n(&__memory_dump_pending, 1, __ATOMIC_RELAXED);
+  }
+}
+
+__attribute__((constructor))
+static void __memory_init() {
+  char *env_var;
+
+  __memory_conf_init();
+  __memory_cache_init();
+  env_var = getenv("MEMORY_CHUNK_FILE");
+  if (env_var != NULL) {
+    memory_chunk_file(env_var, 0);
+  }
+  env_var = getenv("MEMORY_DUMP");
+  if (env_var != NULL) {
+    struct sigaction sa;
+
+    __memory_dump_path = env_var;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = __memory_dump_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR2, &sa, NULL);
+  }
+  env_var = getenv("MEMORY_FORK_COW");
+  if (env_var != NULL) {
+    if (!strcmp(env_var, "yes")) {
+      __memory_fork_cow = 1;
+    }
+  }
+  pthread_atfork(__memory_fork_prepare, __memory_fork_parent,
+		 __memory_fork_child);
+}
+
 static void __memory_print_debug(const char *fmt, ...) {
   va_list valist;
 
@@ -135,9 +1049,13 @@ static void __memory_print_debug(const char *fmt, ...) {
 void *malloc(size_t size) {
   void *ptr;
 
-  pthread_mutex_lock(&memory_management_lock);
-  ptr = __malloc_impl(size);
-  pthread_mutex_unlock(&memory_management_lock);
+  ptr = __memory_cache_malloc(size);
+  if (ptr == NULL) {
+    __memory_lock(&memory_management_lock);
+    ptr = __malloc_impl(size);
+    __memory_unlock(&memory_management_lock);
+  }
+  __memory_dump_deferred();
   __memory_print_debug("malloc(0x%zx) = %p\n", size, ptr);
   return ptr;
 }
@@ -145,9 +1063,9 @@ void *malloc(size_t size) {
 void *calloc(size_t nmemb, size_t size) {
   void *ptr;
 
-  pthread_mutex_lock(&memory_management_lock);
+  __memory_lock(&memory_management_lock);
   ptr = __calloc_impl(nmemb, size);
-  pthread_mutex_unlock(&memory_management_lock);
+  __memory_unlock(&memory_management_lock);
   __memory_print_debug("calloc(0x%zx, 0x%zx) = %p\n", nmemb, size, ptr);
   return ptr;
 }
@@ -155,17 +1073,442 @@ void *calloc(size_t nmemb, size_t size) {
 void *realloc(void *old_ptr, size_t size) {
   void *ptr;
 
-  pthread_mutex_lock(&memory_management_lock);
+  __memory_lock(&memory_management_lock);
   ptr = __realloc_impl(old_ptr, size);
-  pthread_mutex_unlock(&memory_management_lock);
+  __memory_unlock(&memory_management_lock);
   __memory_print_debug("realloc(%p, 0x%zx) = %p\n", old_ptr, size, ptr);
   return ptr;
 }
 
+/* A free() never waits for the lock: small blocks go into the cache of
+   the CPU and if another thread is inside the allocator, the others go
+   onto a lock-free queue that the next malloc() drains. Threads that only free (e.g. consumers of a
+   pipeline) therefore never contend with the allocating threads. */
+static inline void __memory_free(void *ptr) {
+  if (__memory_cache_free(ptr)) return;
+  if (__memory_trylock(&memory_management_lock)) {
+    __free_impl(ptr);
+    __memory_unlock(&memory_management_lock);
+  } else {
+    __free_remote_impl(ptr);
+  }
+}
+
 void free(void *ptr) {
-  pthread_mutex_lock(&memory_management_lock);
-  __free_impl(ptr);
-  pthread_mutex_unlock(&memory_management_lock);
+  __memory_free(ptr);
+  __memory_dump_deferred();
   __memory_print_debug("free(%p)\n", ptr);
 }
 
+/* The caller of free_sized and free_aligned_sized (C23) vouches for
+   the size (and alignment) of the block. Every block carries its
+   header anyway, which is needed to merge it with its neighbours, so
+   the size is not needed to release the block. */
+void free_sized(void *ptr, size_t size) {
+  __memory_free(ptr);
+  __memory_print_debug("free_sized(%p, 0x%zx)\n", ptr, size);
+}
+
+void free_aligned_sized(void *ptr, size_t alignment, size_t size) {
+  __memory_free(ptr);
+  __memory_print_debug("free_aligned_sized(%p, 0x%zx, 0x%zx)\n", ptr, alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+  void *ptr;
+
+  __memory_lock(&memory_management_lock);
+  ptr = __memalign_impl(alignment, size);
+  __memory_unlock(&memory_management_lock);
+  __memory_print_debug("aligned_alloc(0x%zx, 0x%zx) = %p\n", alignment, size, ptr);
+  return ptr;
+}
+
+void *memalign(size_t alignment, size_t size) {
+  void *ptr;
+
+  __memory_lock(&memory_management_lock);
+  ptr = __memalign_impl(alignment, size);
+  __memory_unlock(&memory_management_lock);
+  __memory_print_debug("memalign(0x%zx, 0x%zx) = %p\n", alignment, size, ptr);
+  return ptr;
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+  void *ptr;
+
+  if ((alignment < sizeof(void *)) ||
+      ((alignment & (alignment - ((size_t) 1))) != ((size_t) 0))) return EINVAL;
+  __memory_lock(&memory_management_lock);
+  ptr = __memalign_impl(alignment, size);
+  __memory_unlock(&memory_management_lock);
+  __memory_print_debug("posix_memalign(%p, 0x%zx, 0x%zx) = %p\n", memptr, alignment, size, ptr);
+  if ((ptr == NULL) && (size != ((size_t) 0))) return ENOMEM;
+  *memptr = ptr;
+  return 0;
+}
+
+void *malloc_cacheline(size_t size) {
+  void *ptr;
+
+  __memory_lock(&memory_management_lock);
+  ptr = __malloc_cacheline_impl(size);
+  __memory_unlock(&memory_management_lock);
+  __memory_print_debug("malloc_cacheline(0x%zx) = %p\n", size, ptr);
+  return ptr;
+}
+
+size_t malloc_batch(size_t size, void **ptrs, size_t n) {
+  size_t done;
+
+  __memory_lock(&memory_management_lock);
+  done = __malloc_batch_impl(size, ptrs, n);
+  __memory_unlock(&memory_management_lock);
+  __memory_print_debug("malloc_batch(0x%zx, %p, 0x%zx) = 0x%zx\n", size, ptrs, n, done);
+  return done;
+}
+
+void free_batch(void **ptrs, size_t n) {
+  size_t i;
+
+  __memory_lock(&memory_management_lock);
+  for (i=0; i<n; i++) {
+    __free_impl(ptrs[i]);
+  }
+  __memory_unlock(&memory_management_lock);
+  __memory_print_debug("free_batch(%p, 0x%zx)\n", ptrs, n);
+}
+
+region_t *region_create(void) {
+  region_t *region;
+
+  __memory_lock(&memory_management_lock);
+  region = __region_create_impl();
+  __memory_unlock(&memory_management_lock);
+  __memory_print_debug("region_create() = %p\n", region);
+  return region;
+}
+
+/* The lock is only needed when the current block of the region is
+   exhausted, as a region belongs to a single thread. */
+void *region_alloc(region_t *region, size_t size) {
+  void *ptr;
+
+  ptr = __region_alloc_impl(region, size);
+  if (ptr == NULL) {
+    __memory_lock(&memory_management_lock);
+    ptr = __region_refill_impl(region, size);
+    __memory_unlock(&memory_management_lock);
+  }
+  __memory_print_debug("region_alloc(%p, 0x%zx) = %p\n", region, size, ptr);
+  return ptr;
+}
+
+void region_destroy(region_t *region) {
+  __memory_lock(&memory_management_lock);
+  __region_destroy_impl(region);
+  __memory_unlock(&memory_management_lock);
+  __memory_print_debug("region_destroy(%p)\n", region);
+}
+
+/* Giving memory back
+
+   malloc_trim (as in glibc) and memory_purge release free memory of 
+   the heap to the kernel, see __purge_impl. This is meant for idle
+   phases, as it walks all blocks with the lock held.
+
+*/
+int malloc_trim(size_t pad) {
+  size_t done;
+
+  __memory_lock(&memory_management_lock);
+  done = __purge_impl(pad, 0);
+  __memory_unlock(&memory_management_lock);
+  __memory_print_debug("malloc_trim(0x%zx) = 0x%zx\n", pad, done);
+  return done != ((size_t) 0);
+}
+
+size_t memory_purge(region_t *arena, size_t bytes) {
+  size_t done;
+
+  if (arena != NULL) {
+    done = __region_purge_impl(arena, bytes);
+  } else {
+    __memory_lock(&memory_management_lock);
+    done = __purge_impl(0, bytes);
+    __memory_unlock(&memory_management_lock);
+  }
+  __memory_print_debug("memory_purge(%p, 0x%zx) = 0x%zx\n", arena, bytes, done);
+  return done;
+}
+
+/* Soft limit
+
+   When the heap is about to exceed its soft limit, it calls 
+   __memory_pressure with the memory management lock held. The lock is
+   released while the application's callback runs, so that the 
+   callback can free memory (or even allocate some). This is safe as
+   the heap only calls it before it maps new memory, when it holds no
+   state of its own.
+
+*/
+static memory_pressure_callback_t __memory_pressure_callback = NULL;
+static void *__memory_pressure_arg = NULL;
+
+static void __memory_pressure(size_t bytes) {
+  memory_pressure_callback_t callback;
+  void *arg;
+
+  callback = __memory_pressure_callback;
+  arg = __memory_pressure_arg;
+  if (callback == NULL) return;
+  __memory_unlock(&memory_management_lock);
+  callback(bytes, arg);
+  __memory_lock(&memory_management_lock);
+}
+
+void memory_set_limit(size_t bytes) {
+  __memory_lock(&memory_management_lock);
+  __set_limit_impl(bytes);
+  __memory_unlock(&memory_management_lock);
+}
+
+void memory_set_pressure_callback(memory_pressure_callback_t callback, void *arg) {
+  __memory_lock(&memory_management_lock);
+  __memory_pressure_callback = callback;
+  __memory_pressure_arg = arg;
+  __set_pressure_hook_impl((callback == NULL) ? NULL : __memory_pressure);
+  __memory_unlock(&memory_management_lock);
+}
+
+/* Persistent heaps
+
+   A persistent heap is a file mapped shared in its entirety; the heap
+   itself is managed by the __p*_impl functions. Each heap has its own
+   lock, so it does not contend with malloc. The file is locked with 
+   flock as long as the heap is open, as two processes using the same
+   heap would corrupt it.
+
+*/
+struct pheap {
+  memory_lock_t lock;
+  void *base;
+  size_t size;
+  int fd;
+};
+
+pheap_t *pheap_open(const char *path, size_t size) {
+  struct stat st;
+  pheap_t *heap;
+  void *base;
+  int fd;
+
+  fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd < 0) return NULL;
+  if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+    close(fd);
+    return NULL;
+  }
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return NULL;
+  }
+  if (size > (size_t) st.st_size) {
+    if (ftruncate(fd, (off_t) size) != 0) {
+      close(fd);
+      return NULL;
+    }
+  } else {
+    size = (size_t) st.st_size;
+  }
+  if (size == ((size_t) 0)) {
+    close(fd);
+    return NULL;
+  }
+  base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED) {
+    close(fd);
+    return NULL;
+  }
+  heap = (pheap_t *) malloc(sizeof(pheap_t));
+  if ((heap == NULL) || (__pheap_open_impl(base, size) != 0)) {
+    free(heap);
+    munmap(base, size);
+    close(fd);
+    return NULL;
+  }
+  heap->lock = (memory_lock_t) MEMORY_LOCK_INITIALIZER;
+  heap->base = base;
+  heap->size = size;
+  heap->fd = fd;
+  __memory_print_debug("pheap_open(%s, 0x%zx) = %p\n", path, size, heap);
+  return heap;
+}
+
+int pheap_sync(pheap_t *heap) {
+  return msync(heap->base, heap->size, MS_SYNC);
+}
+
+int pheap_close(pheap_t *heap) {
+  int res;
+
+  if (heap == NULL) return 0;
+  __memory_lock(&heap->lock);
+  __pheap_close_impl(heap->base);
+  __memory_unlock(&heap->lock);
+  res = pheap_sync(heap);
+  munmap(heap->base, heap->size);
+  close(heap->fd);
+  __memory_print_debug("pheap_close(%p)\n", heap);
+  free(heap);
+  return res;
+}
+
+void *pmalloc(pheap_t *heap, size_t size) {
+  void *ptr;
+
+  __memory_lock(&heap->lock);
+  ptr = __pmalloc_impl(heap->base, size);
+  __memory_unlock(&heap->lock);
+  __memory_print_debug("pmalloc(%p, 0x%zx) = %p\n", heap, size, ptr);
+  return ptr;
+}
+
+void pfree(pheap_t *heap, void *ptr) {
+  __memory_lock(&heap->lock);
+  __pfree_impl(heap->base, ptr);
+  __memory_unlock(&heap->lock);
+  __memory_print_debug("pfree(%p, %p)\n", heap, ptr);
+}
+
+void *pheap_root(pheap_t *heap) {
+  return __pheap_root_impl(heap->base);
+}
+
+void pheap_set_root(pheap_t *heap, void *ptr) {
+  __pheap_set_root_impl(heap->base, ptr);
+}
+
+size_t pheap_offset(pheap_t *heap, const void *ptr) {
+  if (ptr == NULL) return 0;
+  return (size_t) (((const char *) ptr) - ((const char *) heap->base));
+}
+
+void *pheap_ptr(pheap_t *heap, size_t offset) {
+  if (offset == ((size_t) 0)) return NULL;
+  return heap->base + offset;
+}
+
+/* C++ operator new and operator delete
+
+   All the replaceable global forms of operator new and operator delete
+   (plain, array, sized, aligned and nothrow) are defined here under
+   their mangled names, so that this file stays plain C. C++ code hence
+   reaches the allocator directly instead of through libstdc++'s
+   operator new, which calls malloc and throws away the alignment.
+
+   On failure, the throwing forms call the installed new handler and
+   retry, and throw std::bad_alloc when there is none. Both functions
+   are taken from libstdc++, which is loaded whenever these operators
+   are called. The nothrow forms return NULL right away, as a handler
+   that throws could not be caught in C.
+
+*/
+typedef void (*__memory_new_handler_t)(void);
+
+extern __memory_new_handler_t _ZSt15get_new_handlerv(void) __attribute__((weak));
+extern void _ZSt17__throw_bad_allocv(void) __attribute__((weak, noreturn));
+
+static void *__memory_new(size_t size, size_t alignment, int nothrow) {
+  void *ptr;
+  __memory_new_handler_t handler;
+
+  if (size == ((size_t) 0)) size = (size_t) 1; /* must be a unique pointer */
+  for (;;) {
+    ptr = NULL;
+    if (alignment <= ((size_t) 16)) ptr = __memory_cache_malloc(size);
+    if (ptr == NULL) {
+      __memory_lock(&memory_management_lock);
+      ptr = __memalign_impl(alignment, size);
+      __memory_unlock(&memory_management_lock);
+    }
+    if ((ptr != NULL) || nothrow) break;
+    handler = NULL;
+    if (_ZSt15get_new_handlerv != NULL) handler = _ZSt15get_new_handlerv();
+    if (handler == NULL) {
+      if (_ZSt17__throw_bad_allocv != NULL) _ZSt17__throw_bad_allocv();
+      abort();
+    }
+    handler();
+  }
+  __memory_print_debug("operator new(0x%zx, 0x%zx) = %p\n", size, alignment, ptr);
+  return ptr;
+}
+
+static inline void __memory_delete(void *ptr) {
+  __memory_free(ptr);
+  __memory_print_debug("operator delete(%p)\n", ptr);
+}
+
+#if __SIZEOF_SIZE_T__ == 8
+/* operator new(std::size_t) and new[] */
+void *_Znwm(size_t size) { return __memory_new(size, 0, 0); }
+void *_Znam(size_t size) { return __memory_new(size, 0, 0); }
+
+/* operator new(std::size_t, const std::nothrow_t &) and new[] */
+void *_ZnwmRKSt9nothrow_t(size_t size, const void *tag) { return __memory_new(size, 0, 1); }
+void *_ZnamRKSt9nothrow_t(size_t size, const void *tag) { return __memory_new(size, 0, 1); }
+
+/* operator new(std::size_t, std::align_val_t), with and without nothrow, and new[] */
+void *_ZnwmSt11align_val_t(size_t size, size_t alignment) { return __memory_new(size, alignment, 0); }
+void *_ZnamSt11align_val_t(size_t size, size_t alignment) { return __memory_new(size, alignment, 0); }
+void *_ZnwmSt11align_val_tRKSt9nothrow_t(size_t size, size_t alignment, const void *tag) { return __memory_new(size, alignment, 1); }
+void *_ZnamSt11align_val_tRKSt9nothrow_t(size_t size, size_t alignment, const void *tag) { return __memory_new(size, alignment, 1); }
+
+/* operator delete(void *) and delete[], plain, sized, aligned and nothrow */
+void _ZdlPv(void *ptr) { __memory_delete(ptr); }
+void _ZdaPv(void *ptr) { __memory_delete(ptr); }
+void _ZdlPvm(void *ptr, size_t size) { __memory_delete(ptr); }
+void _ZdaPvm(void *ptr, size_t size) { __memory_delete(ptr); }
+void _ZdlPvRKSt9nothrow_t(void *ptr, const void *tag) { __memory_delete(ptr); }
+void _ZdaPvRKSt9nothrow_t(void *ptr, const void *tag) { __memory_delete(ptr); }
+void _ZdlPvSt11align_val_t(void *ptr, size_t alignment) { __memory_delete(ptr); }
+void _ZdaPvSt11align_val_t(void *ptr, size_t alignment) { __memory_delete(ptr); }
+void _ZdlPvmSt11align_val_t(void *ptr, size_t size, size_t alignment) { __memory_delete(ptr); }
+void _ZdaPvmSt11align_val_t(void *ptr, size_t size, size_t alignment) { __memory_delete(ptr); }
+void _ZdlPvSt11align_val_tRKSt9nothrow_t(void *ptr, size_t alignment, const void *tag) { __memory_delete(ptr); }
+void _ZdaPvSt11align_val_tRKSt9nothrow_t(void *ptr, size_t alignment, const void *tag) { __memory_delete(ptr); }
+#endif
+
+void memory_get_stats(memory_stats_t *stats) {
+  memory_class_stats_t *cs;
+  memory_cache_bin_t *bin;
+  unsigned int cpu;
+  size_t class;
+
+  if (stats == NULL) return;
+  __memory_lock(&memory_management_lock);
+  stats->lock_acquisitions = memory_management_lock.acquisitions;
+  stats->lock_contended = memory_management_lock.contended;
+  stats->lock_wait_ns = memory_management_lock.wait_ns;
+  __heap_usage_impl(&stats->mapped_bytes, &stats->purged_bytes);
+  stats->cache_budget = __memory_cache_budget;
+  stats->cache_capacity = __memory_cache_capacity;
+  for (class=0; class<MEMORY_CACHE_CLASSES; class++) {
+    cs = &stats->classes[class];
+    cs->size = __class_size_impl(class);
+    cs->hits = 0;
+    cs->misses = __memory_cache_classes[class].misses;
+    cs->flushes = __memory_cache_classes[class].flushes;
+    cs->capacity = 0;
+    cs->cached = 0;
+    /* the stacks change under our feet, the sums are approximate */
+    for (cpu=0; cpu<__memory_cache_cpus; cpu++) {
+      bin = &__memory_caches[cpu].bins[class];
+      cs->hits += __atomic_load_n(&bin->hits, __ATOMIC_RELAXED);
+      cs->capacity += __atomic_load_n(&bin->limit, __ATOMIC_RELAXED);
+      cs->cached += __atomic_load_n(&bin->count, __ATOMIC_RELAXED);
+    }
+  }
+  __memory_unlock(&memory_management_lock);
+}
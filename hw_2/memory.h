@@ -0,0 +1,199 @@
+/*
+
+    Extensions exported by memory.so on top of malloc, calloc, realloc
+    and free.
+
+    Include this file in a program that wants to use them and link it
+    against memory.so (or preload memory.so and declare the functions
+    weak if the program must also run without it).
+
+*/
+
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <stddef.h>
+
+/* Statistics of the allocator.
+
+   The lock counters describe memory_management_lock: how often it was
+   taken, how often a thread found it held by another thread and how
+   long such threads waited for it in total.
+
+   The heap has mapped_bytes of memory mapped, of which purged_bytes
+   were given back to the kernel (see memory_purge) and are not 
+   resident until they are used again.
+
+   classes describes the per-CPU caches of small blocks, one entry per
+   size class, summed over all CPUs: hits counts the requests served
+   from a cache, misses the requests that found it empty and refilled
+   it under the lock, flushes the frees that found it full. capacity
+   is the number of blocks the caches may hold, which adapts to these
+   counts, and cached the number they hold. The capacities of all 
+   classes, in bytes, add up to cache_capacity, which only grows up to
+   cache_budget. The counts stay zero if the caches are disabled.
+
+*/
+#define MEMORY_CACHE_CLASSES 16
+
+typedef struct memory_class_stats {
+  size_t size;                  /* largest request of the class */
+  unsigned long long hits;
+  unsigned long long misses;
+  unsigned long long flushes;
+  size_t capacity;
+  size_t cached;
+} memory_class_stats_t;
+
+typedef struct memory_stats {
+  unsigned long long lock_acquisitions;
+  unsigned long long lock_contended;
+  unsigned long long lock_wait_ns;
+  size_t mapped_bytes;
+  size_t purged_bytes;
+  size_t cache_budget;
+  size_t cache_capacity;
+  memory_class_stats_t classes[MEMORY_CACHE_CLASSES];
+} memory_stats_t;
+
+/* Fills *stats with a consistent snapshot of the statistics. */
+void memory_get_stats(memory_stats_t *stats);
+
+/* C23 sized deallocation. ptr must come from malloc, calloc or realloc
+   (free_sized) or from aligned_alloc (free_aligned_sized) with the
+   given size (and alignment), or be NULL. */
+void free_sized(void *ptr, size_t size);
+void free_aligned_sized(void *ptr, size_t alignment, size_t size);
+
+/* Like malloc, but the block starts on a cache line (64 bytes) and
+   its size is rounded up to whole cache lines, so it shares no cache
+   line with any other object, e.g. for counters or queue nodes that 
+   different threads update. Memory from it is released with free. 
+   (By default, malloc already places requests of 64 bytes or more
+   like that, see the cacheline key of MEMORY_CONF.) */
+void *malloc_cacheline(size_t size);
+
+/* Allocates n blocks of size bytes each into ptrs, taking the lock only
+   once. Returns the number of blocks allocated, which are stored in
+   ptrs[0] to ptrs[returned value - 1]; fewer than n means out of
+   memory. */
+size_t malloc_batch(size_t size, void **ptrs, size_t n);
+
+/* Frees the n blocks in ptrs, taking the lock only once. NULL entries
+   are allowed. */
+void free_batch(void **ptrs, size_t n);
+
+/* Regions (arenas) for memory that is allocated piece by piece and
+   discarded all at once.
+
+   region_alloc is a pointer bump in most cases and only takes the lock
+   when the region needs more memory. Memory from a region must not be
+   passed to free or realloc; region_destroy releases all of it. A
+   region must not be used by several threads at the same time.
+
+*/
+typedef struct region region_t;
+
+region_t *region_create(void);
+void *region_alloc(region_t *region, size_t size);
+void region_destroy(region_t *region);
+
+/* Gives free memory back to the kernel: unmaps the chunks of the heap
+   that are entirely free and drops the pages inside the other free
+   blocks, after taking back the blocks held in the per-CPU cache of
+   the calling thread's CPU; the other CPUs give theirs back when they
+   next use their caches, in time for the next purge. 
+   memory_purge(NULL, bytes) stops after about bytes bytes (0 for all
+   of them); memory_purge(region, bytes) drops the pages of a region 
+   that were not handed out yet. Returns the number of bytes released.
+   malloc_trim(pad) (as in glibc) releases all free memory but the 
+   first pad bytes and returns 1 if it released any. */
+size_t memory_purge(region_t *arena, size_t bytes);
+int malloc_trim(size_t pad);
+
+/* Soft limit on the memory of the heap (mapped minus purged bytes),
+   0 for none; it can also be set with the limit key of MEMORY_CONF.
+   When the heap would exceed it, it first purges its free memory, then
+   calls the pressure callback with the number of bytes missing, so that
+   the application can drop caches of its own. Only if the heap is
+   still over the limit then does the allocation fail. The callback is
+   called without the allocator's lock, but from one thread at a time:
+   allocations that hit the limit in other threads meanwhile fail. */
+typedef void (*memory_pressure_callback_t)(size_t bytes, void *arg);
+
+void memory_set_limit(size_t bytes);
+void memory_set_pressure_callback(memory_pressure_callback_t callback, void *arg);
+
+/* Writes a description of the heap as JSON to the file descriptor fd:
+   every chunk with its occupancy, the histogram of the free blocks, 
+   the largest free block and the external fragmentation. Returns 0 on
+   success, -1 if writing failed. If MEMORY_DUMP is set to a path,
+   SIGUSR2 appends such a dump to that file. heapmap.py turns a dump
+   into an occupancy map. */
+int memory_dump(int fd);
+
+/* Chunk sources
+
+   By default, the allocator maps its chunks with mmap and unmaps them
+   with munmap. memory_set_chunk_hooks makes it take new chunks from
+   hooks->alloc instead, which is called with a multiple of the page
+   size and must return page aligned memory (or NULL, in which case
+   mmap is used for that chunk). Each chunk is given back to the
+   dalloc hook of the source it came from, with the same address and
+   length; dalloc returns 0 if it took the chunk back. The hooks are
+   called with the allocator's lock held and must not call malloc,
+   free etc. NULL restores mmap. Returns 0 on success, -1 if too many
+   sources were registered.
+
+   memory_chunk_file installs a source that hands out chunks of a file,
+   e.g. on a tmpfs or hugetlbfs mount, extending it to size bytes if it
+   is smaller (size 0 uses the file as it is). It can also be selected
+   by setting MEMORY_CHUNK_FILE to the path of the file. Returns 0 on
+   success, -1 otherwise.
+
+*/
+typedef struct memory_chunk_hooks {
+  void *(*alloc)(size_t length, void *arg);
+  int (*dalloc)(void *addr, size_t length, void *arg);
+  void *arg;
+} memory_chunk_hooks_t;
+
+int memory_set_chunk_hooks(const memory_chunk_hooks_t *hooks);
+int memory_chunk_file(const char *path, size_t size);
+
+/* Persistent heaps
+
+   A persistent heap lives in a file and keeps its contents when the
+   process ends, e.g. for an index that must not be rebuilt after a
+   restart. pheap_open opens the heap in the file at path, creating
+   the file or extending it to size bytes if needed (size 0 uses the
+   file as it is), and returns NULL if the file holds something else,
+   is in use by another process or cannot be mapped.
+
+   The heap is mapped at a different address each time it is opened,
+   so pointers must not be stored in it: store the offsets given by 
+   pheap_offset and turn them back into pointers with pheap_ptr. 
+   Offset 0 stands for NULL. The root object (e.g. the head of the 
+   index) is where a program finds its data again after opening the
+   heap.
+
+   The heap stays consistent if the process dies at any time; a block
+   allocated but not yet linked from the root is leaked then. The data
+   reach the disk when pheap_sync or pheap_close return 0. Each heap
+   has a lock of its own; pmalloc and pfree may be called from several
+   threads.
+
+*/
+typedef struct pheap pheap_t;
+
+pheap_t *pheap_open(const char *path, size_t size);
+int pheap_close(pheap_t *heap);
+int pheap_sync(pheap_t *heap);
+void *pmalloc(pheap_t *heap, size_t size);
+void pfree(pheap_t *heap, void *ptr);
+void *pheap_root(pheap_t *heap);
+void pheap_set_root(pheap_t *heap, void *ptr);
+size_t pheap_offset(pheap_t *heap, const void *ptr);
+void *pheap_ptr(pheap_t *heap, size_t offset);
+
+#endif
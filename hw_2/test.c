@@ -1,12 +1,96 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "memory.h"
 //#include "implementation.h"
 
+/*
+ * Tests of memory.so. Build and run them in this directory with
+ *
+ *   gcc -g -Wall -pthread test.c -o test ./memory.so -Wl,-rpath,. && ./test
+ *
+ * Without arguments all tests run, each in a new process of this
+ * program with the name of the test as argument (./test <name> runs
+ * one test), and with the environment variable the test needs, if
+ * any, as memory.so reads its settings at startup.
+ */
+
 #define SIZE_1 ((size_t) 16)
 #define SIZE_2 ((size_t) 32)
 #define SIZE_3 (18777216) // 16 MB
 
-int main(int argc, char *argv[]){
+#define CHECK(cond) do { \
+        if (!(cond)){ \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1); \
+        } \
+    } while (0)
+
+static char *self;
+
+// resident memory of the process in bytes, read without allocating
+static size_t resident(void){
+    char buf[128];
+    unsigned long size, pages;
+    ssize_t n;
+    int fd = open("/proc/self/statm", O_RDONLY);
+
+    CHECK(fd >= 0);
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    CHECK(n > 0);
+    buf[n] = '\0';
+    CHECK(sscanf(buf, "%lu %lu", &size, &pages) == 2);
+    return pages * (size_t) sysconf(_SC_PAGESIZE);
+}
+
+static memory_stats_t stats(void){
+    memory_stats_t st;
+
+    memory_get_stats(&st);
+    return st;
+}
+
+// 1 if the per-CPU caches are in use (rseq is available)
+static int caches_enabled(void){
+    return stats().cache_budget != 0;
+}
+
+// writes memory_dump into buf as a string
+static int dump(char *buf, size_t size){
+    FILE *f = tmpfile();
+    size_t len;
+
+    CHECK(f != NULL);
+    if (memory_dump(fileno(f)) != 0) return -1;
+    rewind(f);
+    len = fread(buf, 1, size - 1, f);
+    buf[len] = '\0';
+    fclose(f);
+    return 0;
+}
+
+// value of the first field key in a dump
+static size_t dump_field(const char *buf, const char *key){
+    char pattern[64];
+    const char *p;
+
+    snprintf(pattern, sizeof(pattern), "\"%s\": ", key);
+    p = strstr(buf, pattern);
+    CHECK(p != NULL);
+    return strtoull(p + strlen(pattern), NULL, 0);
+}
+
+static void test_basic(void){
     char *c_1, *c_2, *c_3, *c_4;
     int *i_1, *i_2;
     //c_1 = (char *) __malloc_impl(SIZE_1);
@@ -38,14 +122,14 @@ int main(int argc, char *argv[]){
     //__free_impl(c_3);
     free(c_2);
 
-    i_1 = (int *) malloc(SIZE_1);
+    i_1 = (int *) malloc(SIZE_1 * sizeof(int));
     for (int i = 0; i < SIZE_1; i++){
         i_1[i] = i;
         printf("%d ", i_1[i]);
     }
     printf("\n");
 
-    i_1 = (int *) realloc(i_1, SIZE_2);
+    i_1 = (int *) realloc(i_1, SIZE_2 * sizeof(int));
     for (int i = 0; i < SIZE_2; i++){
         i_1[i] = i;
         printf("%d ", i_1[i]);
@@ -82,6 +166,1311 @@ int main(int argc, char *argv[]){
     free(c_4);
     //__free_impl(c_4);
     //__free_impl(c_4);
+}
+
+/* Remote frees: threads that free while another thread holds the lock
+   queue their blocks, and the next malloc takes them back. The blocks
+   must neither be lost nor handed out while still queued. */
+#define REMOTE_THREADS 4
+#define REMOTE_BLOCKS 4000
+
+static char *remote_blocks[REMOTE_BLOCKS];
+
+static void *remote_free_thread(void *arg){
+    long t = (long) arg;
+
+    for (int i = t; i < REMOTE_BLOCKS; i += REMOTE_THREADS){
+        CHECK(remote_blocks[i][0] == (char) i && remote_blocks[i][999] == (char) i);
+        free(remote_blocks[i]);
+    }
+    return NULL;
+}
+
+static void test_remote_free(void){
+    pthread_t threads[REMOTE_THREADS];
+    char *mine[REMOTE_BLOCKS];
+
+    for (int round = 0; round < 50; round++){
+        for (int i = 0; i < REMOTE_BLOCKS; i++){
+            remote_blocks[i] = malloc(1000);
+            CHECK(remote_blocks[i] != NULL);
+            memset(remote_blocks[i], i, 1000);
+        }
+        for (long t = 0; t < REMOTE_THREADS; t++)
+            CHECK(pthread_create(&threads[t], NULL, remote_free_thread, (void *) t) == 0);
+        // allocate while the other threads free, so that they find the lock held
+        for (int i = 0; i < REMOTE_BLOCKS; i++){
+            mine[i] = malloc(1000);
+            CHECK(mine[i] != NULL);
+            memset(mine[i], ~i, 1000);
+        }
+        for (int t = 0; t < REMOTE_THREADS; t++)
+            pthread_join(threads[t], NULL);
+        for (int i = 0; i < REMOTE_BLOCKS; i++){
+            CHECK(mine[i][0] == (char) ~i && mine[i][999] == (char) ~i);
+            free(mine[i]);
+        }
+    }
+    // 50 rounds of 8 MB; the freed blocks must have been reused
+    CHECK(resident() < (size_t) 64 << 20);
+}
+
+/* The lock counts every acquisition; a thread that finds it held 
+   counts a contention and the time until it gets it. */
+#define LOCK_THREADS 4
+#define LOCK_ROUNDS 20000
+
+static void *lock_thread(void *arg){
+    long t = (long) arg;
+    char *p;
+
+    for (int i = 0; i < LOCK_ROUNDS; i++){
+        p = malloc(2000);
+        CHECK(p != NULL);
+        memset(p, t, 2000);
+        CHECK(p[0] == (char) t && p[1999] == (char) t);
+        free(p);
+    }
+    return NULL;
+}
+
+static void test_lock(void){
+    pthread_t threads[LOCK_THREADS];
+    memory_stats_t before, after;
+
+    before = stats();
+    for (long t = 0; t < LOCK_THREADS; t++)
+        CHECK(pthread_create(&threads[t], NULL, lock_thread, (void *) t) == 0);
+    for (int t = 0; t < LOCK_THREADS; t++)
+        pthread_join(threads[t], NULL);
+    after = stats();
+
+    // every malloc takes the lock; a free may queue its block instead
+    CHECK(after.lock_acquisitions - before.lock_acquisitions >= LOCK_THREADS * LOCK_ROUNDS);
+    CHECK(after.lock_contended - before.lock_contended <= 
+          after.lock_acquisitions - before.lock_acquisitions);
+    CHECK(after.lock_contended != before.lock_contended || 
+          after.lock_wait_ns == before.lock_wait_ns);
+}
+
+/* Free blocks are kept by size: a request gets the smallest free block
+   that fits, wherever it lies in the heap. */
+static void test_best_fit(void){
+    size_t sizes[] = {3000, 5000, 4000, 6000};
+    char *holes[4], *walls[5], *p;
+
+    walls[0] = malloc(2000);
+    for (int i = 0; i < 4; i++){
+        holes[i] = malloc(sizes[i]);
+        walls[i + 1] = malloc(2000);
+        CHECK(holes[i] != NULL && walls[i + 1] != NULL);
+    }
+    for (int i = 0; i < 4; i++)
+        free(holes[i]);
+
+    p = malloc(3900);
+    CHECK(p == holes[2]);
+    free(p);
+    p = malloc(2900);
+    CHECK(p == holes[0]);
+    free(p);
+    p = malloc(4500);
+    CHECK(p == holes[1]);
+    free(p);
+    p = malloc(5500);
+    CHECK(p == holes[3]);
+    free(p);
+
+    for (int i = 0; i < 5; i++)
+        free(walls[i]);
+
+    // many free blocks of random sizes: blocks must not overlap
+    char *live[1000] = {0};
+    size_t len[1000];
+
+    srand(28);
+    for (int i = 0; i < 100000; i++){
+        int j = rand() % 1000;
+
+        if (live[j] != NULL){
+            CHECK(live[j][0] == (char) j && live[j][len[j] - 1] == (char) j);
+            free(live[j]);
+        }
+        len[j] = 300 + rand() % 20000;
+        live[j] = malloc(len[j]);
+        CHECK(live[j] != NULL);
+        memset(live[j], j, len[j]);
+    }
+    for (int j = 0; j < 1000; j++)
+        free(live[j]);
+}
+
+/* fork() while another thread is inside the allocator: the child must
+   find the heap consistent and the lock free. */
+static volatile int fork_stop;
+
+static void *fork_thread(void *arg){
+    char *p;
+
+    while (!fork_stop){
+        p = malloc(2000);
+        CHECK(p != NULL);
+        free(p);
+        free(malloc(100));
+    }
+    return NULL;
+}
+
+static void fork_child(void){
+    char *p[100];
+
+    alarm(10); // a deadlock fails the test
+    for (int i = 0; i < 100; i++){
+        p[i] = malloc(i * 100 + 1);
+        if (p[i] == NULL) _exit(1);
+        memset(p[i], i, i * 100 + 1);
+    }
+    for (int i = 0; i < 100; i++)
+        free(p[i]);
+    _exit(0);
+}
+
+static void test_fork(void){
+    pthread_t thread;
+    int status;
+    pid_t pid;
+
+    CHECK(pthread_create(&thread, NULL, fork_thread, NULL) == 0);
+    for (int i = 0; i < 50; i++){
+        pid = fork();
+        CHECK(pid >= 0);
+        if (pid == 0) fork_child();
+        CHECK(waitpid(pid, &status, 0) == pid);
+        CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+    fork_stop = 1;
+    pthread_join(thread, NULL);
+}
+
+/* MEMORY_FORK_COW=yes: the child never reuses memory it inherited, 
+   not even blocks that were free or that it frees itself. */
+static void test_fork_cow(void){
+    char *inherited[200], *p;
+    char *lo = NULL, *hi = NULL;
+    int status;
+    pid_t pid;
+
+    for (int i = 0; i < 200; i++){
+        inherited[i] = malloc(1000);
+        CHECK(inherited[i] != NULL);
+        memset(inherited[i], i, 1000);
+        if (lo == NULL || inherited[i] < lo) lo = inherited[i];
+        if (hi == NULL || inherited[i] + 1000 > hi) hi = inherited[i] + 1000;
+    }
+    for (int i = 0; i < 200; i += 2)
+        free(inherited[i]);
+
+    pid = fork();
+    CHECK(pid >= 0);
+    if (pid == 0){
+        for (int i = 1; i < 200; i += 2)
+            free(inherited[i]);
+        for (int i = 0; i < 2000; i++){
+            p = malloc(1000);
+            CHECK(p != NULL);
+            CHECK(p + 1000 <= lo || p >= hi);
+            memset(p, 0xff, 1000);
+        }
+        for (int i = 1; i < 200; i += 2)
+            CHECK(inherited[i][0] == (char) i && inherited[i][999] == (char) i);
+        // realloc copies an inherited block
+        p = realloc(inherited[1], 2000);
+        CHECK(p != NULL && (p + 2000 <= lo || p >= hi));
+        CHECK(p[0] == 1 && p[999] == 1);
+        _exit(0);
+    }
+    CHECK(waitpid(pid, &status, 0) == pid);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+
+/* Sized and aligned deallocation and the batch entry points. */
+static void test_sized_batch(void){
+    void *ptrs[500], *p;
+    memory_stats_t before, after;
 
+    for (size_t size = 1; size < 100000; size = size * 3 + 1){
+        p = malloc(size);
+        CHECK(p != NULL);
+        memset(p, 1, size);
+        free_sized(p, size);
+    }
+    free_sized(NULL, 0);
+
+    for (size_t align = 8; align <= 65536; align *= 2){
+        p = aligned_alloc(align, align * 3);
+        CHECK(p != NULL && (uintptr_t) p % align == 0);
+        memset(p, 2, align * 3);
+        free_aligned_sized(p, align, align * 3);
+        CHECK(posix_memalign(&p, align, 100) == 0 && (uintptr_t) p % align == 0);
+        free(p);
+    }
+    CHECK(posix_memalign(&p, 24, 100) != 0);
+    free_aligned_sized(NULL, 64, 0);
+
+    for (size_t size = 8; size <= 5000; size *= 5){
+        before = stats();
+        CHECK(malloc_batch(size, ptrs, 500) == 500);
+        after = stats();
+        // one for the batch, one for memory_get_stats
+        CHECK(after.lock_acquisitions - before.lock_acquisitions <= 2);
+        for (int i = 0; i < 500; i++){
+            CHECK(ptrs[i] != NULL);
+            memset(ptrs[i], i, size);
+        }
+        for (int i = 0; i < 500; i++)
+            CHECK(((char *) ptrs[i])[0] == (char) i && ((char *) ptrs[i])[size - 1] == (char) i);
+        ptrs[7] = NULL;
+        before = stats();
+        free_batch(ptrs, 500);
+        after = stats();
+        CHECK(after.lock_acquisitions - before.lock_acquisitions <= 2);
+    }
+    CHECK(malloc_batch(100, ptrs, 0) == 0);
+}
+
+/* The C++ operators new and delete (declared by their mangled names, 
+   as this is C) go straight to the allocator: memory a delete releases
+   is what the next malloc of that size gets. */
+typedef struct { char c; } nothrow_t;
+void *_Znwm(size_t);
+void *_Znam(size_t);
+void *_ZnwmRKSt9nothrow_t(size_t, const nothrow_t *);
+void *_ZnamRKSt9nothrow_t(size_t, const nothrow_t *);
+void *_ZnwmSt11align_val_t(size_t, size_t);
+void *_ZnamSt11align_val_t(size_t, size_t);
+void _ZdlPv(void *);
+void _ZdaPv(void *);
+void _ZdlPvm(void *, size_t);
+void _ZdaPvm(void *, size_t);
+void _ZdlPvSt11align_val_t(void *, size_t);
+void _ZdaPvmSt11align_val_t(void *, size_t, size_t);
+
+static void test_operator_new(void){
+    nothrow_t nothrow;
+    void *p;
+
+    p = _Znwm(5000);
+    memset(p, 1, 5000);
+    _ZdlPv(p);
+    CHECK(malloc(5000) == p);
+    free(p);
+
+    p = _Znam(5000);
+    _ZdaPv(p);
+    CHECK(malloc(5000) == p);
+    free(p);
+
+    p = _Znwm(5000);
+    _ZdlPvm(p, 5000);
+    CHECK(malloc(5000) == p);
+    free(p);
+
+    p = _Znam(5000);
+    _ZdaPvm(p, 5000);
+    CHECK(malloc(5000) == p);
+    free(p);
+
+    p = _ZnwmRKSt9nothrow_t(5000, &nothrow);
+    CHECK(p != NULL);
+    free(p);
+    CHECK(_ZnwmRKSt9nothrow_t((size_t) -4096, &nothrow) == NULL);
+    CHECK(_ZnamRKSt9nothrow_t((size_t) -4096, &nothrow) == NULL);
+
+    for (size_t align = 16; align <= 8192; align *= 2){
+        p = _ZnwmSt11align_val_t(300, align);
+        CHECK((uintptr_t) p % align == 0);
+        _ZdlPvSt11align_val_t(p, align);
+        p = _ZnamSt11align_val_t(300, align);
+        CHECK((uintptr_t) p % align == 0);
+        _ZdaPvmSt11align_val_t(p, 300, align);
+    }
+}
+
+/* Regions hand out aligned, separate pieces of memory and give all of
+   it back at once. */
+static void test_region(void){
+    region_t *region;
+    char *p[3000];
+    size_t len[3000], first = 0;
+
+    srand(32);
+    for (int round = 0; round < 20; round++){
+        region = region_create();
+        CHECK(region != NULL);
+        CHECK(region_alloc(region, 0) == NULL);
+        for (int i = 0; i < 3000; i++){
+            // now and then a piece larger than the blocks of the region
+            len[i] = i % 500 == 0 ? 5000000 : 1 + rand() % 3000;
+            p[i] = region_alloc(region, len[i]);
+            CHECK(p[i] != NULL && (uintptr_t) p[i] % 16 == 0);
+            memset(p[i], i, len[i]);
+        }
+        for (int i = 0; i < 3000; i++)
+            CHECK(p[i][0] == (char) i && p[i][len[i] - 1] == (char) i);
+        region_destroy(region);
+        // the memory of a destroyed region is reused by the next one
+        if (round == 0) first = resident();
+        CHECK(resident() < first + (16 << 20));
+    }
+}
+
+/* MEMORY_CONF=bogus:1,chunk:4M,large:1M,cache:64K,limit:junk,thp:maybe
+   sets the chunk size and the large threshold and ignores the unknown
+   key and the bad values. */
+#define CONF "bogus:1,chunk:4M,large:1M,cache:64K,limit:junk,thp:maybe"
+
+static void test_conf(void){
+    char *p[8], *q;
+    int run = 1;
+
+    // blocks of 1000000 bytes follow each other within a chunk, of
+    // which a 4 MB chunk holds no more than four
+    for (int i = 0; i < 8; i++){
+        p[i] = malloc(1000000);
+        CHECK(p[i] != NULL);
+        if (i > 0 && p[i] == p[i - 1] + 1000064){
+            CHECK(++run <= 4);
+        } else {
+            run = 1;
+        }
+    }
+
+    // from 1 MB on, a request gets a mapping of its own, right behind
+    // the header on the first page
+    for (int i = 0; i < 4; i++){
+        q = malloc((1 << 20) + i * 100000);
+        CHECK(q != NULL && (uintptr_t) q % 4096 == 64);
+        free(q);
+    }
+
+    // no limit
+    q = malloc(64 << 20);
+    CHECK(q != NULL);
+    free(q);
+    for (int i = 0; i < 8; i++)
+        free(p[i]);
+}
+
+/* The pairs of MEMORY_CONF that memory.so ignores are reported on
+   stderr of a process started with them, the valid ones are not. */
+static void test_conf_reject(void){
+    char buf[4096];
+    int fds[2], status, lines = 0;
+    ssize_t n, len = 0;
+    pid_t pid;
+
+    CHECK(pipe(fds) == 0);
+    fflush(stdout);
+    pid = fork();
+    CHECK(pid >= 0);
+    if (pid == 0){
+        dup2(fds[1], STDERR_FILENO);
+        setenv("MEMORY_CONF", CONF ",decay:,decay:off,chunk:100", 1);
+        execl(self, self, "basic", (char *) NULL);
+        _exit(127);
+    }
+    close(fds[1]);
+    while ((n = read(fds[0], buf + len, sizeof(buf) - 1 - len)) > 0)
+        len += n;
+    close(fds[0]);
+    buf[len] = '\0';
+    CHECK(waitpid(pid, &status, 0) == pid);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    for (char *c = buf; (c = strstr(c, "MEMORY_CONF: ignoring ")) != NULL; c++)
+        lines++;
+    CHECK(lines == 5);
+    CHECK(strstr(buf, "ignoring bogus:1\n") != NULL);
+    CHECK(strstr(buf, "ignoring limit:junk\n") != NULL);
+    CHECK(strstr(buf, "ignoring thp:maybe\n") != NULL);
+    CHECK(strstr(buf, "ignoring decay:\n") != NULL);
+    CHECK(strstr(buf, "ignoring chunk:100\n") != NULL);
+}
+
+/* MEMORY_CONF=cache:off: all requests take the lock. */
+static void test_conf_cache_off(void){
+    size_t before = stats().lock_acquisitions;
+    memory_stats_t st;
+    void *p;
+
+    for (int i = 0; i < 1000; i++){
+        p = malloc(i % 256 + 1);
+        CHECK(p != NULL);
+        free(p);
+    }
+    st = stats();
+    CHECK(st.cache_budget == 0 && st.cache_capacity == 0);
+    for (int c = 0; c < MEMORY_CACHE_CLASSES; c++)
+        CHECK(st.classes[c].hits == 0 && st.classes[c].cached == 0);
+    CHECK(st.lock_acquisitions - before >= 2000);
+}
+
+/* MEMORY_CONF=thp:on,chunk:3M: chunks and large mappings are aligned
+   to 2 MB and their sizes rounded up to whole huge pages. */
+static void test_thp(void){
+    char *p[12], *q;
+    int run = 1, longest = 1;
+    memory_stats_t st;
+    size_t limit;
+
+    // a 4 MB chunk holds four blocks of 1000000 bytes, a 3 MB one three
+    for (int i = 0; i < 12; i++){
+        p[i] = malloc(1000000);
+        CHECK(p[i] != NULL);
+        if (i > 0 && p[i] == p[i - 1] + 1000064){
+            if (++run > longest) longest = run;
+        } else {
+            // a new chunk
+            if (i > 0) CHECK((uintptr_t) (p[i] - 64) % (2 << 20) == 0);
+            run = 1;
+        }
+    }
+    CHECK(longest == 4);
+
+    for (int i = 0; i < 4; i++){
+        q = malloc((5 << 20) + i * 300000);
+        CHECK(q != NULL && (uintptr_t) (q - 64) % (2 << 20) == 0);
+        free(q);
+    }
+
+    // the limit holds for the 6 MB that a 5 MB request really maps
+    malloc_trim(0);
+    st = stats();
+    limit = st.mapped_bytes - st.purged_bytes + (5 << 20) + (1 << 19);
+    memory_set_limit(limit);
+    q = malloc(5 << 20);
+    st = stats();
+    CHECK(q == NULL || st.mapped_bytes - st.purged_bytes <= limit);
+    free(q);
+    memory_set_limit(0);
+
+    for (int i = 0; i < 12; i++)
+        free(p[i]);
+}
+
+// 1 if all pages of [addr, addr + len) are resident
+static int in_core(void *addr, size_t len){
+    unsigned char vec[4096];
+    size_t pages = (len + 4095) / 4096;
+
+    CHECK(pages <= sizeof(vec) && (uintptr_t) addr % 4096 == 0);
+    CHECK(mincore(addr, len, vec) == 0);
+    for (size_t i = 0; i < pages; i++){
+        if (!(vec[i] & 1)) return 0;
+    }
+    return 1;
+}
+
+/* MEMORY_CONF=reserve:8M,populate:on: an 8 MB chunk is mapped and
+   prefaulted at startup and kept when it is free; new mappings are
+   prefaulted too. */
+static void test_reserve(void){
+    char *p, *q, *page;
+
+    // the first requests are served from the reserve, near its start
+    p = malloc(1000);
+    CHECK(p != NULL);
+    page = (char *) ((uintptr_t) p & ~(uintptr_t) 4095);
+    CHECK(in_core(page, 7 << 20));
+
+    q = malloc(5 << 20);
+    CHECK(q != NULL);
+    CHECK(in_core((void *) ((uintptr_t) q & ~(uintptr_t) 4095), 5 << 20));
+    free(q);
+    free(p);
+
+    // still mapped (mincore fails on unmapped pages) and still warm,
+    // even after purges
+    CHECK(in_core(page, 7 << 20));
+    malloc_trim(0);
+    memory_purge(NULL, 0);
+    CHECK(in_core(page, 7 << 20));
+}
+
+/* Chunk hooks: chunks come from the alloc hook and go back to the
+   dalloc hook of their source, even after the hooks were replaced. */
+#define POOL_SIZE ((size_t) 64 << 20)
+
+static char *pool;
+static size_t pool_used;
+static int pool_allocs, pool_dallocs;
+
+static void *pool_alloc(size_t length, void *arg){
+    void *ptr;
+
+    CHECK(arg == &pool && length % 4096 == 0);
+    if (pool_used + length > POOL_SIZE) return NULL;
+    ptr = pool + pool_used;
+    pool_used += length;
+    pool_allocs++;
+    return ptr;
+}
+
+static int pool_dalloc(void *addr, size_t length, void *arg){
+    CHECK((char *) addr >= pool && (char *) addr + length <= pool + POOL_SIZE);
+    pool_dallocs++;
     return 0;
 }
+
+static int in_pool(void *ptr){
+    return (char *) ptr >= pool && (char *) ptr < pool + POOL_SIZE;
+}
+
+static void test_chunk_hooks(void){
+    memory_chunk_hooks_t hooks = {pool_alloc, pool_dalloc, &pool};
+    void *p, *q, *r;
+
+    pool = mmap(NULL, POOL_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    CHECK(pool != MAP_FAILED);
+    CHECK(memory_set_chunk_hooks(&hooks) == 0);
+
+    p = malloc(5 << 20);
+    CHECK(in_pool(p) && pool_allocs == 1);
+    memset(p, 1, 5 << 20);
+    free(p);
+    CHECK(pool_dallocs == 1);
+
+    // when the pool is exhausted, the heap maps the chunk itself
+    p = malloc(40 << 20);
+    q = malloc(40 << 20);
+    CHECK(in_pool(p) && q != NULL && !in_pool(q));
+    free(q);
+
+    CHECK(memory_set_chunk_hooks(NULL) == 0);
+    r = malloc(5 << 20);
+    CHECK(r != NULL && !in_pool(r));
+    free(r);
+    // p still goes back to the pool
+    free(p);
+    CHECK(pool_dallocs == 2);
+}
+
+// 1 if ptr lies in a mapping of the file at path
+static int in_file(void *ptr, const char *path){
+    char line[512];
+    unsigned long start, end;
+    int found = 0;
+    FILE *f = fopen("/proc/self/maps", "r");
+
+    CHECK(f != NULL);
+    while (!found && fgets(line, sizeof(line), f) != NULL){
+        if (sscanf(line, "%lx-%lx", &start, &end) == 2 && strstr(line, path) != NULL)
+            found = (uintptr_t) ptr >= start && (uintptr_t) ptr < end;
+    }
+    fclose(f);
+    return found;
+}
+
+/* A heap on a file: chunks are taken from the file, which only one
+   heap may use, and a forked child gets a private copy of the heap as
+   it was at the fork, not the parent's later writes. */
+static void test_chunk_file(void){
+    const char *path = "/tmp/memory-test.heap";
+    int to_child[2], status;
+    char *p, c;
+    pid_t pid;
+
+    unlink(path);
+    CHECK(memory_chunk_file(path, 64 << 20) == 0);
+    CHECK(memory_chunk_file(path, 64 << 20) == -1);
+    for (int i = 0; i < 100; i++)
+        memset(malloc(100000), i, 100000);
+    p = malloc(1 << 20);
+    CHECK(p != NULL && in_file(p, path));
+    strcpy(p, "before fork");
+    CHECK(pipe(to_child) == 0);
+
+    pid = fork();
+    CHECK(pid >= 0);
+    if (pid == 0){
+        CHECK(read(to_child[0], &c, 1) == 1);
+        CHECK(!strcmp(p, "before fork"));
+        strcpy(p, "child");
+        for (int i = 0; i < 100; i++)
+            memset(malloc(100000), 0xff, 100000);
+        _exit(0);
+    }
+    strcpy(p, "parent");
+    CHECK(write(to_child[1], "x", 1) == 1);
+    CHECK(waitpid(pid, &status, 0) == pid);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    CHECK(!strcmp(p, "parent"));
+    unlink(path);
+}
+
+/* Persistent heaps: a linked list stored as offsets survives closing
+   the heap and the death of the process that wrote it. */
+struct pnode {
+    size_t next; // offset of the next node
+    int value;
+};
+
+static void test_pheap(void){
+    const char *path = "/tmp/memory-test.pheap";
+    struct pnode *node;
+    pheap_t *heap;
+    size_t *root;
+    int status, n;
+    FILE *f;
+    pid_t pid;
+
+    unlink(path);
+    heap = pheap_open(path, 4 << 20);
+    CHECK(heap != NULL);
+    CHECK(pheap_root(heap) == NULL);
+    CHECK(pheap_open(path, 0) == NULL); // in use
+    root = pmalloc(heap, sizeof(size_t));
+    *root = 0;
+    pheap_set_root(heap, root);
+    for (int i = 0; i < 1000; i++){
+        node = pmalloc(heap, sizeof(*node) + i);
+        CHECK(node != NULL);
+        node->value = i;
+        node->next = *root;
+        *root = pheap_offset(heap, node);
+    }
+    CHECK(pheap_ptr(heap, 0) == NULL && pheap_offset(heap, NULL) == 0);
+    CHECK(pheap_close(heap) == 0);
+
+    // a process that dies without closing the heap
+    pid = fork();
+    CHECK(pid >= 0);
+    if (pid == 0){
+        heap = pheap_open(path, 0);
+        CHECK(heap != NULL);
+        root = pheap_root(heap);
+        for (int i = 0; i < 500; i++){
+            node = pheap_ptr(heap, *root);
+            *root = node->next;
+            pfree(heap, node);
+        }
+        CHECK(pheap_sync(heap) == 0);
+        node = pmalloc(heap, 100000); // leaked
+        abort();
+    }
+    CHECK(waitpid(pid, &status, 0) == pid);
+
+    heap = pheap_open(path, 0);
+    CHECK(heap != NULL);
+    root = pheap_root(heap);
+    n = 0;
+    for (node = pheap_ptr(heap, *root); node != NULL; node = pheap_ptr(heap, node->next)){
+        CHECK(node->value == 499 - n);
+        n++;
+    }
+    CHECK(n == 500);
+    CHECK(pheap_close(heap) == 0);
+
+    // a file that does not hold a heap
+    f = fopen(path, "w");
+    CHECK(f != NULL);
+    for (int i = 0; i < 100000; i++)
+        fputs("not a heap ", f);
+    fclose(f);
+    CHECK(pheap_open(path, 0) == NULL);
+    unlink(path);
+}
+
+/* malloc_trim and memory_purge give free memory back to the kernel:
+   empty chunks are unmapped, the pages of other free blocks dropped. */
+static void test_trim(void){
+    char *p[400], *q;
+    region_t *region;
+    size_t before, released;
+
+    for (int i = 0; i < 400; i++){
+        p[i] = malloc(100000);
+        CHECK(p[i] != NULL);
+        memset(p[i], i, 100000);
+    }
+    for (int i = 1; i < 400; i++)
+        free(p[i]);
+
+    before = resident();
+    CHECK(malloc_trim(0) == 1);
+    // everything but p[0] and the blocks around it is released
+    CHECK(resident() + (8 << 20) < before);
+    CHECK(p[0][0] == 0 && p[0][99999] == 0);
+    CHECK(malloc_trim(0) == 0);
+
+    // purged memory is reused
+    q = malloc(1000000);
+    CHECK(q != NULL);
+    memset(q, 1, 1000000);
+    free(q);
+
+    // a bounded purge stops after about the bytes asked for
+    for (int i = 1; i < 400; i++){
+        p[i] = malloc(100000);
+        memset(p[i], i, 100000);
+    }
+    for (int i = 1; i < 400; i += 2)
+        free(p[i]);
+    released = memory_purge(NULL, 4096);
+    CHECK(released >= 4096 && released < 1000000);
+    CHECK(memory_purge(NULL, 0) > 0);
+    CHECK(memory_purge(NULL, 0) == 0);
+    for (int i = 0; i < 400; i += 2){
+        CHECK(p[i][0] == (char) i && p[i][99999] == (char) i);
+        free(p[i]);
+    }
+
+    // the untouched rest of a region
+    region = region_create();
+    CHECK(region != NULL);
+    q = region_alloc(region, 100);
+    memset(q, 2, 100);
+    CHECK(memory_purge(region, 0) > 0);
+    CHECK(q[0] == 2 && q[99] == 2);
+    q = region_alloc(region, 1000);
+    CHECK(q != NULL);
+    memset(q, 3, 1000);
+    region_destroy(region);
+}
+
+/* The soft limit (run with MEMORY_CONF=chunk:4M): the heap purges its
+   free memory before failing, and asks the pressure callback, which
+   here drops blocks of an application cache. */
+struct app_cache {
+    char *blocks[100];
+    int count;
+    int calls;
+};
+
+static void drop_cache(size_t bytes, void *arg){
+    struct app_cache *cache = arg;
+    size_t dropped = 0;
+
+    cache->calls++;
+    while (dropped < bytes && cache->count > 0){
+        free(cache->blocks[--cache->count]);
+        dropped += 1 << 20;
+    }
+}
+
+static void test_limit(void){
+    struct app_cache cache = {{0}, 0, 0};
+    memory_stats_t st;
+    char *a, *b, *c, *d;
+    size_t limit;
+
+    // a free block inside a chunk must be purged to make room
+    a = malloc(1 << 20);
+    b = malloc(2 << 20);
+    c = malloc(1 << 20);
+    memset(b, 1, 2 << 20);
+    free(b);
+    st = stats();
+    limit = st.mapped_bytes - st.purged_bytes + (3 << 20);
+    memory_set_limit(limit);
+    d = malloc(3 << 20);
+    CHECK(d != NULL);
+    st = stats();
+    CHECK(st.mapped_bytes - st.purged_bytes <= limit);
+    free(d);
+    free(c);
+    free(a);
+
+    // without a callback, allocations fail at the limit
+    malloc_trim(0);
+    st = stats();
+    memory_set_limit(st.mapped_bytes - st.purged_bytes + (8 << 20));
+    while ((a = malloc(1 << 20)) != NULL){
+        CHECK(cache.count < 100);
+        cache.blocks[cache.count++] = a;
+    }
+    CHECK(cache.count >= 4 && cache.count <= 8);
+
+    // with it, they succeed as long as the cache can give memory back
+    memory_set_pressure_callback(drop_cache, &cache);
+    for (int i = 0; i < 20; i++){
+        a = malloc(1 << 20);
+        CHECK(a != NULL);
+        memset(a, i, 1 << 20);
+        free(a);
+    }
+    CHECK(cache.calls > 0 && cache.count < 8);
+
+    memory_set_pressure_callback(NULL, NULL);
+    memory_set_limit(0);
+    a = malloc(64 << 20);
+    CHECK(a != NULL);
+    free(a);
+    while (cache.count > 0)
+        free(cache.blocks[--cache.count]);
+}
+
+/* memory_dump describes every chunk; the totals agree with the stats.
+   Run with MEMORY_DUMP set, SIGUSR2 appends a dump to that file. */
+static void test_dump(void){
+    const char *keys[] = {"mapped_bytes", "purged_bytes", "remote_frees", "free_bytes",
+                          "free_blocks", "largest_free", "fragmentation", "histogram", "chunks"};
+    static char buf[1 << 16];
+    char key[32], *walls[2], *hole, *c;
+    size_t sizes = 0, free_bytes = 0;
+    FILE *f;
+
+    walls[0] = malloc(10000);
+    hole = malloc(50000);
+    walls[1] = malloc(10000);
+    free(hole);
+
+    CHECK(dump(buf, sizeof(buf)) == 0);
+    CHECK(buf[0] == '{');
+    for (int i = 0; i < sizeof(keys) / sizeof(keys[0]); i++){
+        snprintf(key, sizeof(key), "\"%s\": ", keys[i]);
+        CHECK(strstr(buf, key) != NULL);
+    }
+    CHECK(dump_field(buf, "mapped_bytes") == stats().mapped_bytes);
+    CHECK(dump_field(buf, "largest_free") >= 50000);
+    c = strstr(buf, "\"chunks\"");
+    for (c = strstr(c, "\"addr\": "); c != NULL; c = strstr(c + 1, "\"addr\": ")){
+        sizes += dump_field(c, "size");
+        free_bytes += dump_field(c, "free_bytes");
+        CHECK(dump_field(c, "used_bytes") + dump_field(c, "free_bytes") <= dump_field(c, "size"));
+    }
+    CHECK(sizes == dump_field(buf, "mapped_bytes"));
+    CHECK(free_bytes == dump_field(buf, "free_bytes"));
+
+    unlink(getenv("MEMORY_DUMP"));
+    CHECK(kill(getpid(), SIGUSR2) == 0);
+    free(malloc(100)); // in case the signal found the lock held
+    f = fopen(getenv("MEMORY_DUMP"), "r");
+    CHECK(f != NULL);
+    CHECK(fgets(buf, sizeof(buf), f) != NULL && strstr(buf, "{\"mapped_bytes\": ") == buf);
+    fclose(f);
+    unlink(getenv("MEMORY_DUMP"));
+
+    free(walls[0]);
+    free(walls[1]);
+}
+
+// index of the class of requests of size bytes
+static int class_of(const memory_stats_t *st, size_t size){
+    int c = 0;
+
+    while (st->classes[c].size < size)
+        c++;
+    return c;
+}
+
+/* Per-CPU caches of small blocks: a freed block is the next one of its
+   class handed out on that CPU, blocks never go to two threads at once,
+   and malloc_trim takes the cached blocks back. */
+#define CACHE_THREADS 8
+
+static void *cache_thread(void *arg){
+    long t = (long) arg;
+    char *p[64];
+
+    for (int round = 0; round < 20000; round++){
+        for (int i = 0; i < 64; i++){
+            p[i] = malloc(1 + (i * 7 + round) % 256);
+            CHECK(p[i] != NULL);
+            p[i][0] = (char) t;
+        }
+        for (int i = 0; i < 64; i++){
+            CHECK(p[i][0] == (char) t);
+            free(p[i]);
+        }
+    }
+    return NULL;
+}
+
+static void test_cache(void){
+    pthread_t threads[CACHE_THREADS];
+    memory_stats_t st;
+    size_t hits = 0, cached = 0;
+    cpu_set_t all, one;
+    void *p, *q;
+
+    if (!caches_enabled()){
+        printf("no per-CPU caches here, skipped\n");
+        return;
+    }
+    for (long t = 0; t < CACHE_THREADS; t++)
+        CHECK(pthread_create(&threads[t], NULL, cache_thread, (void *) t) == 0);
+    for (int t = 0; t < CACHE_THREADS; t++)
+        pthread_join(threads[t], NULL);
+
+    st = stats();
+    for (int c = 0; c < MEMORY_CACHE_CLASSES; c++){
+        hits += st.classes[c].hits;
+        cached += st.classes[c].cached;
+        CHECK(st.classes[c].cached <= st.classes[c].capacity);
+    }
+    CHECK(hits > CACHE_THREADS * 20000 * 64 / 2 && cached > 0);
+
+    // on one CPU, the block freed last is the next one handed out
+    CHECK(sched_getaffinity(0, sizeof(all), &all) == 0);
+    CPU_ZERO(&one);
+    CPU_SET(sched_getcpu(), &one);
+    CHECK(sched_setaffinity(0, sizeof(one), &one) == 0);
+    p = malloc(32);
+    free(p);
+    q = malloc(32);
+    free(q);
+    CHECK(q == p);
+
+    // malloc_trim empties the caches of this CPU, the other CPUs empty
+    // theirs on their next cached request, which refills one class
+    malloc_trim(0);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++){
+        if (!CPU_ISSET(cpu, &all)) continue;
+        CPU_ZERO(&one);
+        CPU_SET(cpu, &one);
+        CHECK(sched_setaffinity(0, sizeof(one), &one) == 0);
+        free(malloc(32));
+    }
+    CHECK(sched_setaffinity(0, sizeof(all), &all) == 0);
+    st = stats();
+    cached = 0;
+    for (int c = 0; c < MEMORY_CACHE_CLASSES; c++){
+        if (c != class_of(&st, 32)) cached += st.classes[c].cached;
+    }
+    CHECK(cached == 0);
+}
+
+static int cmp_ptr(const void *a, const void *b){
+    uintptr_t x = *(uintptr_t *) a, y = *(uintptr_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+// 1 if the blocks start on cache lines and none shares a line with another
+static int on_own_lines(void **p, int n, size_t size){
+    qsort(p, n, sizeof(p[0]), cmp_ptr);
+    for (int i = 0; i < n; i++){
+        if ((uintptr_t) p[i] % 64 != 0) return 0;
+        if (i > 0 && (char *) p[i] - (char *) p[i - 1] < (size + 63) / 64 * 64) return 0;
+    }
+    return 1;
+}
+
+/* Blocks from malloc_cacheline, and by default from malloc for more
+   than 48 bytes, have cache lines of their own. */
+static void test_cacheline(void){
+    void *p[100];
+
+    for (size_t size = 1; size <= 600; size += 7){
+        for (int i = 0; i < 100; i++)
+            p[i] = malloc_cacheline(size);
+        CHECK(on_own_lines(p, 100, size));
+        for (int i = 0; i < 100; i++)
+            free(p[i]);
+    }
+    for (size_t size = 49; size <= 600; size += 7){
+        for (int i = 0; i < 100; i++)
+            p[i] = malloc(size);
+        CHECK(on_own_lines(p, 100, size));
+        for (int i = 0; i < 100; i++)
+            free(p[i]);
+    }
+}
+
+/* MEMORY_CONF=cacheline:off: malloc packs blocks, malloc_cacheline
+   still does not. */
+static void test_cacheline_off(void){
+    void *p[100];
+
+    for (int i = 0; i < 100; i++)
+        p[i] = malloc(100);
+    CHECK(!on_own_lines(p, 100, 100));
+    for (int i = 0; i < 100; i++)
+        free(p[i]);
+    for (int i = 0; i < 100; i++)
+        p[i] = malloc_cacheline(100);
+    CHECK(on_own_lines(p, 100, 100));
+    for (int i = 0; i < 100; i++)
+        free(p[i]);
+}
+
+// bytes of all chunks in a dump that are taken by allocated blocks
+static size_t used_bytes(void){
+    static char buf[1 << 16];
+    size_t used = 0;
+    char *c;
+
+    CHECK(dump(buf, sizeof(buf)) == 0);
+    for (c = strstr(strstr(buf, "\"chunks\""), "\"addr\": "); c != NULL;
+            c = strstr(c + 1, "\"addr\": "))
+        used += dump_field(c, "used_bytes");
+    return used;
+}
+
+/* MEMORY_CONF=cache:off: a block placed on a line behind a short one
+   leaves the short block as long as it was, the bytes in between make
+   a free block of their own. */
+static void test_cacheline_gap(void){
+    size_t used;
+    char *a[8], *b[8];
+
+    for (int i = 0; i < 8; i++){
+        a[i] = malloc(16);
+        used = used_bytes();
+        b[i] = malloc(200);
+        CHECK((uintptr_t) b[i] % 64 == 0);
+        CHECK(used_bytes() == used + 64 + 256);
+    }
+    for (int i = 0; i < 8; i++){
+        free(a[i]);
+        free(b[i]);
+    }
+}
+
+/* MEMORY_CONF=defer:on,chunk:2M: freed blocks wait on quick lists for
+   requests of their size and are only merged when no free block fits,
+   so that a large request still finds the memory they make up. */
+static void test_defer(void){
+    static char buf[1 << 16];
+    void *p[1800], *q;
+    size_t mapped;
+
+    for (int i = 0; i < 1800; i++){
+        p[i] = malloc(1000);
+        CHECK(p[i] != NULL);
+    }
+    for (int i = 0; i < 1800; i++)
+        free(p[i]);
+    CHECK(dump(buf, sizeof(buf)) == 0);
+    CHECK(dump_field(buf, "quick_bytes") >= 1800 * 1000);
+
+    q = malloc(1000);
+    CHECK(q == p[1799]);
+    free(q);
+
+    mapped = stats().mapped_bytes;
+    q = malloc(1500000);
+    CHECK(q != NULL);
+    CHECK(stats().mapped_bytes <= mapped);
+    CHECK(dump(buf, sizeof(buf)) == 0);
+    CHECK(dump_field(buf, "quick_bytes") == 0);
+    free(q);
+}
+
+// makes the cache of the class of size run empty and full rounds times
+static void churn(size_t size, int rounds){
+    void *p[500];
+
+    for (int r = 0; r < rounds; r++){
+        for (int i = 0; i < 500; i++)
+            p[i] = malloc(size);
+        for (int i = 0; i < 500; i++)
+            free(p[i]);
+    }
+}
+
+/* The capacity of a cache grows while its class is busy, within the
+   budget, and shrinks again when the class goes unused. */
+static void test_cache_adapt(void){
+    size_t cpus = sysconf(_SC_NPROCESSORS_CONF), start = 16 * cpus, busy;
+    memory_stats_t st;
+    cpu_set_t one;
+    int c;
+
+    if (!caches_enabled()){
+        printf("no per-CPU caches here, skipped\n");
+        return;
+    }
+    // all on one CPU, whose caches adapt
+    CPU_ZERO(&one);
+    CPU_SET(sched_getcpu(), &one);
+    CHECK(sched_setaffinity(0, sizeof(one), &one) == 0);
+
+    st = stats();
+    c = class_of(&st, 256);
+    CHECK(st.classes[c].capacity == start);
+    churn(256, 20);
+    st = stats();
+    busy = st.classes[c].capacity;
+    CHECK(busy > start && busy <= start - 16 + 128);
+    CHECK(st.cache_capacity <= st.cache_budget);
+
+    // another class keeps the lock busy, the class of 256 idles
+    churn(24, 200);
+    st = stats();
+    CHECK(st.classes[c].capacity < busy);
+    CHECK(st.classes[class_of(&st, 24)].capacity > start);
+    CHECK(st.cache_capacity <= st.cache_budget);
+}
+
+/* MEMORY_CONF=cache:8K: the initial capacities already exceed the
+   budget, so no cache grows. */
+static void test_cache_budget(void){
+    size_t start = 16 * sysconf(_SC_NPROCESSORS_CONF);
+    memory_stats_t st;
+
+    if (!caches_enabled()){
+        printf("no per-CPU caches here, skipped\n");
+        return;
+    }
+    churn(256, 20);
+    st = stats();
+    CHECK(st.cache_budget == 8 << 10);
+    CHECK(st.classes[class_of(&st, 256)].capacity <= start);
+}
+
+/* MEMORY_CONF=decay:off: idle classes keep their capacity. */
+static void test_cache_decay_off(void){
+    memory_stats_t st;
+    cpu_set_t one;
+    size_t busy;
+    int c;
+
+    if (!caches_enabled()){
+        printf("no per-CPU caches here, skipped\n");
+        return;
+    }
+    CPU_ZERO(&one);
+    CPU_SET(sched_getcpu(), &one);
+    CHECK(sched_setaffinity(0, sizeof(one), &one) == 0);
+
+    churn(256, 20);
+    st = stats();
+    c = class_of(&st, 256);
+    busy = st.classes[c].capacity;
+    churn(24, 200);
+    st = stats();
+    CHECK(st.classes[c].capacity == busy);
+}
+
+// class whose counters a malloc of size bytes moves
+static size_t class_used(size_t size){
+    memory_stats_t before, after;
+    int found = -1;
+    void *p;
+
+    before = stats();
+    p = malloc(size);
+    after = stats();
+    free(p);
+    for (int c = 0; c < MEMORY_CACHE_CLASSES; c++){
+        if (after.classes[c].hits + after.classes[c].misses != 
+            before.classes[c].hits + before.classes[c].misses){
+            CHECK(found == -1);
+            found = c;
+        }
+    }
+    CHECK(found != -1);
+    return after.classes[found].size;
+}
+
+/* Every request of up to 256 bytes lands in the smallest class that
+   holds it: in 16-byte steps, and in whole cache lines for more than
+   48 bytes unless MEMORY_CONF=cacheline:off. */
+static void check_classes(int lines){
+    size_t expected;
+
+    if (!caches_enabled()){
+        printf("no per-CPU caches here, skipped\n");
+        return;
+    }
+    for (size_t size = 1; size <= 256; size++){
+        expected = (size + 15) / 16 * 16;
+        if (lines && size > 48) expected = (size + 63) / 64 * 64;
+        CHECK(class_used(size) == expected);
+    }
+}
+
+static void test_classes(void){
+    check_classes(1);
+}
+
+static void test_classes_plain(void){
+    check_classes(0);
+}
+
+struct test {
+    const char *name;
+    void (*fn)(void);
+    const char *var;    // environment variable the test needs, or NULL
+    const char *value;
+};
+
+static struct test tests[] = {
+    {"basic", test_basic, NULL, NULL},
+    {"remote_free", test_remote_free, NULL, NULL},
+    {"lock", test_lock, NULL, NULL},
+    {"best_fit", test_best_fit, NULL, NULL},
+    {"fork", test_fork, NULL, NULL},
+    {"fork_cow", test_fork_cow, "MEMORY_FORK_COW", "yes"},
+    {"sized_batch", test_sized_batch, NULL, NULL},
+    {"operator_new", test_operator_new, NULL, NULL},
+    {"region", test_region, NULL, NULL},
+    {"conf", test_conf, "MEMORY_CONF", CONF},
+    {"conf_reject", test_conf_reject, NULL, NULL},
+    {"conf_cache_off", test_conf_cache_off, "MEMORY_CONF", "cache:off"},
+    {"thp", test_thp, "MEMORY_CONF", "thp:on,chunk:3M"},
+    {"reserve", test_reserve, "MEMORY_CONF", "reserve:8M,populate:on"},
+    {"chunk_hooks", test_chunk_hooks, NULL, NULL},
+    {"chunk_file", test_chunk_file, NULL, NULL},
+    {"pheap", test_pheap, NULL, NULL},
+    {"trim", test_trim, NULL, NULL},
+    {"limit", test_limit, "MEMORY_CONF", "chunk:4M"},
+    {"dump", test_dump, "MEMORY_DUMP", "/tmp/memory-test.dump"},
+    {"cache", test_cache, NULL, NULL},
+    {"cacheline", test_cacheline, NULL, NULL},
+    {"cacheline_off", test_cacheline_off, "MEMORY_CONF", "cacheline:off"},
+    {"cacheline_gap", test_cacheline_gap, "MEMORY_CONF", "cache:off"},
+    {"defer", test_defer, "MEMORY_CONF", "defer:on,chunk:2M"},
+    {"cache_adapt", test_cache_adapt, NULL, NULL},
+    {"cache_budget", test_cache_budget, "MEMORY_CONF", "cache:8K"},
+    {"cache_decay_off", test_cache_decay_off, "MEMORY_CONF", "decay:off"},
+    {"classes", test_classes, NULL, NULL},
+    {"classes_plain", test_classes_plain, "MEMORY_CONF", "cacheline:off"},
+};
+
+#define NUM_TESTS (sizeof(tests) / sizeof(tests[0]))
+
+// runs a test in a new process of this program, with var set to value
+static int run(struct test *test){
+    int status;
+    pid_t pid;
+
+    fflush(stdout);
+    pid = fork();
+    CHECK(pid >= 0);
+    if (pid == 0){
+        if (test->var != NULL) setenv(test->var, test->value, 1);
+        execl(self, self, test->name, (char *) NULL);
+        _exit(127);
+    }
+    CHECK(waitpid(pid, &status, 0) == pid);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main(int argc, char *argv[]){
+    int failed = 0;
+
+    self = argv[0];
+    if (argc > 1){
+        for (int i = 0; i < NUM_TESTS; i++){
+            if (!strcmp(argv[1], tests[i].name)){
+                tests[i].fn();
+                return 0;
+            }
+        }
+        printf("unknown test %s\n", argv[1]);
+        return 1;
+    }
+    for (int i = 0; i < NUM_TESTS; i++){
+        if (run(&tests[i])){
+            printf("%s: ok\n", tests[i].name);
+        } else {
+            printf("%s: FAILED\n", tests[i].name);
+            failed++;
+        }
+    }
+    return failed != 0;
+}
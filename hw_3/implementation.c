@@ -236,10 +236,12 @@
 /* YOUR HELPER FUNCTIONS GO HERE */
 
 #define MAX_FILE_NAME ((size_t) 256)
-#define MAGIC_NUM ((size_t) 1)
+#define NAME_INLINE ((size_t) 24) // names up to this length - 1 fit in a dirent
+#define MAGIC_NUM ((size_t) 6) // changes with the layout of the filesystem
 #define MIN_SIZE ((size_t) 4096)
 
 typedef size_t offset_t;
+typedef size_t inode_num_t; // index into the inode table, 0 for none
 
 typedef struct memory_block {
     size_t size; // usable memory
@@ -253,22 +255,65 @@ enum inode_enum_type {
     REG_FILE
 };
 
+/*
+ * The contents of a file are a sequence of extents, sorted by start 
+ * and without gaps: extent i holds the bytes start to start + length - 1
+ * of the file, extent i + 1 begins where it ends. The extent holding an
+ * offset is found by binary search. The last extent is the tail of the
+ * file; appends fill its slack (capacity - length) first.
+ */
+typedef struct extent {
+    size_t start; // offset in the file
+    size_t length;
+    size_t capacity; // bytes allocated at data
+    offset_t data; // to capacity bytes
+} extent_t;
+
 typedef struct inode_struct_file{
    size_t size; 
-   offset_t first_block; // to file_block
+   size_t num_extents;
+   size_t max_extents; // number of extents extents has room for
+   offset_t extents; // to extent_t[max_extents]
 } inode_file_t;
 
-typedef struct file_block {
-    size_t block_size; 
-    offset_t nxt_file_block; // next file block
-    offset_t data; // to data_block
-} file_block_t;
-
 typedef struct inode_struct_dir{
     size_t num_children;
-    offset_t children;  
+    size_t capacity; // number of entries children has room for
+    offset_t children; // to dirent_t[capacity]
+    size_t index_size; // number of slots of the hash index, 0 if none
+    offset_t index; // to index_slot_t[index_size]
 } inode_dir_t;
 
+/*
+ * Entry of a directory: the name of a child and its inode. Renaming or
+ * removing a child only moves its entry; the inode stays where it is.
+ * A name shorter than NAME_INLINE is stored in the entry itself, a
+ * longer one in an allocation of its own. As names are never empty,
+ * name.inline_name[0] == '\0' marks the latter.
+ */
+typedef struct dirent {
+    inode_num_t ino;
+    union {
+        char inline_name[NAME_INLINE]; // '\0' terminated
+        struct {
+            char tag; // '\0'
+            offset_t offset; // to the name, '\0' terminated
+        } overflow;
+    } name;
+} dirent_t;
+
+/*
+ * Hash index of the children of a directory: an open addressing table
+ * with linear probing, index_size a power of two and at most half full.
+ * A slot holds the hash of the name of a child and the position of its
+ * entry in children plus one, or 0 if it is empty. Like everything else
+ * it is stored in the filesystem and survives remounting.
+ */
+typedef struct index_slot {
+    size_t hash;
+    size_t pos;
+} index_slot_t;
+
 static inline offset_t ptr_to_offset(void *ptr, void *fstpr){
     if (ptr < fstpr) return 0;
     return (offset_t) (ptr - fstpr);
@@ -280,30 +325,48 @@ static inline void *offset_to_ptr(void *ptr, offset_t offset){
 }
 
 /*
- * Contains metadata about a file
+ * Contains metadata about a file. Its name is in the entry of its 
+ * directory.
  */
 typedef struct inode {
-    char name[MAX_FILE_NAME];
     struct timespec mod_time;
     struct timespec acc_time;
     inode_type_t type;
     union {
         inode_file_t file;  
         inode_dir_t directory;
+        inode_num_t nxt_free; // next unused inode
     } value;
 } inode_t;
 
+/*
+ * Inode table: inode ino is entry ino % INODES_PER_CHUNK of chunk 
+ * ino / INODES_PER_CHUNK. The table grows by whole chunks, which never
+ * move, so an inode keeps its number and its address for its lifetime.
+ * Unused inodes are linked through nxt_free; inode 0 is never used.
+ */
 typedef struct super_block {
     uint32_t magic;
     size_t size;
     offset_t free_memory;
-    offset_t root_dir;
+    inode_num_t root_dir;
+    offset_t inode_chunks; // to offset_t[max_chunks], each to inode_t[INODES_PER_CHUNK]
+    size_t num_chunks;
+    size_t max_chunks;
+    inode_num_t free_inodes;
 } super_block_t;
 
 #define SUPER_BLOCK_SIZE ((size_t) sizeof(super_block_t))
 #define MEM_BLOCK_SIZE ((size_t) sizeof(memory_block_t))
 #define INODE_SIZE ((size_t) sizeof(inode_t))
-#define FILE_BLOCK_SIZE ((size_t) sizeof(file_block_t))
+#define EXTENT_SIZE ((size_t) sizeof(extent_t))
+#define DIRENT_SIZE ((size_t) sizeof(dirent_t))
+#define INDEX_SLOT_SIZE ((size_t) sizeof(index_slot_t))
+#define INDEX_MIN_SIZE ((size_t) 8)
+#define DIR_MIN_CAPACITY ((size_t) 4)
+#define INODES_PER_CHUNK ((size_t) 64)
+#define FILE_MIN_EXTENTS ((size_t) 4)
+#define FILE_MAX_SLACK ((size_t) 1 << 20) // most an append reserves ahead
 
 super_block_t *get_handle(void *fsptr, size_t size){
     super_block_t *handle = (super_block_t*) fsptr;
@@ -327,7 +390,11 @@ super_block_t *get_handle(void *fsptr, size_t size){
             handle->free_memory = ptr_to_offset(block, fsptr);
         }           
 
-        handle->root_dir =(offset_t) 0;
+        handle->root_dir = (inode_num_t) 0;
+        handle->inode_chunks = (offset_t) 0;
+        handle->num_chunks = (size_t) 0;
+        handle->max_chunks = (size_t) 0;
+        handle->free_inodes = (inode_num_t) 0;
     }
      
     return handle;
@@ -362,20 +429,16 @@ memory_block_t *get_memory_block(super_block_t *handle, size_t size){
         return NULL;
     }
 
-    if (cur->size - size > (size_t) 0){ // create new next block
-        //if ((cur->size - size) < MEM_BLOCK_SIZE){ // not enough memory to create
-        //    next = (memory_block_t *) handle;
-        //}
-
-        //else{
+    // a rest too small for the header of a block stays with cur
+    if (cur->size - size >= MEM_BLOCK_SIZE){ // create new next block
         next = (memory_block_t *) offset_to_ptr(cur, size);
         next->size = cur->size - size;
         next->nxt_block = cur->nxt_block;
-        //}
     }
 
     else { // already exists a next block
         next = (memory_block_t *) offset_to_ptr(handle, cur->nxt_block);
+        size = cur->size;
     }
 
     // cur is first available memory block
@@ -444,7 +507,8 @@ offset_t allocate_memory(super_block_t *handle, size_t size){
 
     if (size == ((size_t) 0)) return (offset_t) 0;
 
-    s = size + MEM_BLOCK_SIZE;
+    // whole words, so that every block header stays aligned
+    s = (size + MEM_BLOCK_SIZE + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1);
     if (s < size) return (offset_t) 0;
 
     ptr = (void *) get_memory_block(handle, s);
@@ -486,78 +550,636 @@ offset_t reallocate_memory(super_block_t *handle, offset_t offset, size_t size){
     return newOffset;
 }
 
-inode_t *get_path(super_block_t *handle, const char *path){
-    inode_t *node, *child;
-    char *index, *__path, *name, file_name[MAX_FILE_NAME];
-    size_t size;
+// grow the allocation at offset to size bytes without moving it, -1 if the memory after it is not free
+int grow_memory(super_block_t *handle, offset_t offset, size_t size){
+    memory_block_t *block, *cur, *prev, *next;
+    offset_t nxt_block;
+    size_t s, rest;
+
+    block = (memory_block_t *) (offset_to_ptr(handle, offset) - MEM_BLOCK_SIZE);
+    s = (size + MEM_BLOCK_SIZE + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1);
+    if (s < size) return -1;
+    if (block->size >= s) return 0;
+
+    // the free list is sorted by address
+    for (cur = (memory_block_t *) offset_to_ptr(handle, handle->free_memory),
+            prev = NULL; cur != NULL && (void *) cur < (void *) block; prev = cur,
+            cur = (memory_block_t *) offset_to_ptr(handle, cur->nxt_block));
+
+    if (cur == NULL || (void *) cur != ((void *) block) + block->size
+            || block->size + cur->size < s)
+        return -1;
+
+    // the header of the rest may overlap the one of cur, read it first
+    rest = block->size + cur->size - s;
+    nxt_block = cur->nxt_block;
+    if (rest >= MEM_BLOCK_SIZE){ // the rest stays free
+        next = (memory_block_t *) (((void *) block) + s);
+        next->size = rest;
+        next->allocated = (size_t) 0;
+        next->nxt_block = nxt_block;
+        block->size = s;
+    }
+    else{
+        next = (memory_block_t *) offset_to_ptr(handle, nxt_block);
+        block->size += cur->size;
+    }
+
+    if (prev == NULL)
+        handle->free_memory = ptr_to_offset(next, handle);
+    else
+        prev->nxt_block = ptr_to_offset(next, handle);
+    return 0;
+}
+
+// shrink the allocation at offset to size bytes without moving it, the rest becomes free
+void shrink_memory(super_block_t *handle, offset_t offset, size_t size){
+    memory_block_t *block, *rest;
+    size_t s;
+
+    block = (memory_block_t *) (offset_to_ptr(handle, offset) - MEM_BLOCK_SIZE);
+    s = (size + MEM_BLOCK_SIZE + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1);
+
+    // a rest too small for the header of a block stays with block
+    if (block->size < s + MEM_BLOCK_SIZE)
+        return;
+    rest = (memory_block_t *) (((void *) block) + s);
+    rest->size = block->size - s;
+    rest->allocated = (size_t) 0;
+    block->size = s;
+    add_to_free_memory(handle, ptr_to_offset(rest, handle));
+}
+
+inode_t *get_inode(super_block_t *handle, inode_num_t ino){
+    offset_t *chunks;
+
+    if (ino == (inode_num_t) 0 || ino / INODES_PER_CHUNK >= handle->num_chunks)
+        return NULL;
+    chunks = (offset_t *) offset_to_ptr(handle, handle->inode_chunks);
+    return ((inode_t *) offset_to_ptr(handle, chunks[ino / INODES_PER_CHUNK]))
+        + ino % INODES_PER_CHUNK;
+}
+
+// take an unused inode, growing the table if needed; 0 if out of memory
+inode_num_t allocate_inode(super_block_t *handle){
+    offset_t chunks, chunk;
+    inode_num_t ino, first;
+    size_t max_chunks;
+
+    if (handle->free_inodes == (inode_num_t) 0){
+        if (handle->num_chunks == handle->max_chunks){
+            max_chunks = handle->max_chunks * 2;
+            if (max_chunks == (size_t) 0){
+                max_chunks = (size_t) 8;
+                chunks = allocate_memory(handle, max_chunks * sizeof(offset_t));
+            }
+            else
+                chunks = reallocate_memory(handle, handle->inode_chunks,
+                        max_chunks * sizeof(offset_t));
+            if (chunks == (offset_t) 0)
+                return (inode_num_t) 0;
+            handle->inode_chunks = chunks;
+            handle->max_chunks = max_chunks;
+        }
+
+        chunk = allocate_memory(handle, INODES_PER_CHUNK * INODE_SIZE);
+        if (chunk == (offset_t) 0)
+            return (inode_num_t) 0;
+        ((offset_t *) offset_to_ptr(handle, handle->inode_chunks))[handle->num_chunks] = chunk;
+        first = handle->num_chunks * INODES_PER_CHUNK;
+        handle->num_chunks++;
+
+        // lowest numbers first, inode 0 stays unused
+        for (ino = first + INODES_PER_CHUNK - 1; ino >= first && ino != (inode_num_t) 0; ino--){
+            get_inode(handle, ino)->value.nxt_free = handle->free_inodes;
+            handle->free_inodes = ino;
+        }
+    }
+
+    ino = handle->free_inodes;
+    handle->free_inodes = get_inode(handle, ino)->value.nxt_free;
+    return ino;
+}
+
+void free_inode(super_block_t *handle, inode_num_t ino){
+    get_inode(handle, ino)->value.nxt_free = handle->free_inodes;
+    handle->free_inodes = ino;
+}
+
+size_t name_hash(const char *name, size_t len){
+    size_t hash = (size_t) 14695981039346656037ULL; // FNV-1a
+
+    for (size_t i = 0; i < len; i++){
+        hash ^= (size_t) (unsigned char) name[i];
+        hash *= (size_t) 1099511628211ULL;
+    }
+    return hash;
+}
+
+static inline char *entry_name(super_block_t *handle, dirent_t *entry){
+    if (entry->name.inline_name[0] != '\0')
+        return entry->name.inline_name;
+    return (char *) offset_to_ptr(handle, entry->name.overflow.offset);
+}
+
+// store name (len bytes) in entry, -1 if out of memory
+int set_entry_name(super_block_t *handle, dirent_t *entry, const char *name, size_t len){
+    offset_t offset;
+    char *dest;
+
+    if (len < NAME_INLINE){
+        dest = entry->name.inline_name;
+    }
+    else{
+        offset = allocate_memory(handle, len + 1);
+        if (offset == (offset_t) 0)
+            return -1;
+        entry->name.overflow.tag = '\0';
+        entry->name.overflow.offset = offset;
+        dest = (char *) offset_to_ptr(handle, offset);
+    }
+    memcpy(dest, name, len);
+    dest[len] = '\0';
+    return 0;
+}
+
+void free_entry_name(super_block_t *handle, dirent_t *entry){
+    if (entry->name.inline_name[0] == '\0')
+        free_memory(handle, entry->name.overflow.offset);
+}
+
+static inline dirent_t *dir_entry(super_block_t *handle, inode_t *dir, size_t pos){
+    return ((dirent_t *) offset_to_ptr(handle, dir->value.directory.children)) + pos;
+}
+
+static inline size_t entry_pos(super_block_t *handle, inode_t *dir, dirent_t *entry){
+    return (size_t) (entry - ((dirent_t *) offset_to_ptr(handle,
+                    dir->value.directory.children)));
+}
+
+// slot of the entry of dir named name (len bytes), or the empty slot ending its probe
+index_slot_t *index_slot(super_block_t *handle, inode_t *dir, const char *name,
+        size_t len, size_t hash){
+    index_slot_t *slots;
+    char *entry;
+    size_t mask, i;
+
+    slots = (index_slot_t *) offset_to_ptr(handle, dir->value.directory.index);
+    mask = dir->value.directory.index_size - 1;
+    for (i = hash & mask; slots[i].pos != 0; i = (i + 1) & mask){
+        if (slots[i].hash != hash)
+            continue;
+        entry = entry_name(handle, dir_entry(handle, dir, slots[i].pos - 1));
+        if (strncmp(entry, name, len) == 0 && entry[len] == '\0')
+            break;
+    }
+    return &slots[i];
+}
+
+// slot of the entry at position pos of dir
+index_slot_t *index_find(super_block_t *handle, inode_t *dir, size_t pos){
+    index_slot_t *slots;
+    char *name;
+    size_t mask, i;
+
+    name = entry_name(handle, dir_entry(handle, dir, pos));
+    slots = (index_slot_t *) offset_to_ptr(handle, dir->value.directory.index);
+    mask = dir->value.directory.index_size - 1;
+    for (i = name_hash(name, strlen(name)) & mask;
+            slots[i].pos != pos + 1; i = (i + 1) & mask);
+    return &slots[i];
+}
+
+dirent_t *dir_lookup(super_block_t *handle, inode_t *dir, const char *name, size_t len){
+    index_slot_t *slot;
+
+    if (dir->value.directory.index_size == (size_t) 0)
+        return NULL;
+    slot = index_slot(handle, dir, name, len, name_hash(name, len));
+    if (slot->pos == (size_t) 0)
+        return NULL;
+    return dir_entry(handle, dir, slot->pos - 1);
+}
+
+// rebuild the index of dir with size slots (0 to drop it), -1 if out of memory
+int index_resize(super_block_t *handle, inode_t *dir, size_t size){
+    index_slot_t *slots;
+    offset_t index;
+    char *name;
+    size_t hash, mask, i;
+
+    index = (offset_t) 0;
+    if (size != (size_t) 0){
+        index = allocate_memory(handle, size * INDEX_SLOT_SIZE);
+        if (index == (offset_t) 0)
+            return -1;
+        slots = (index_slot_t *) offset_to_ptr(handle, index);
+        memset(slots, 0, size * INDEX_SLOT_SIZE);
+        mask = size - 1;
+        for (size_t pos = 0; pos < dir->value.directory.num_children; pos++){
+            name = entry_name(handle, dir_entry(handle, dir, pos));
+            hash = name_hash(name, strlen(name));
+            for (i = hash & mask; slots[i].pos != 0; i = (i + 1) & mask);
+            slots[i].hash = hash;
+            slots[i].pos = pos + 1;
+        }
+    }
+    if (dir->value.directory.index != (offset_t) 0)
+        free_memory(handle, dir->value.directory.index);
+    dir->value.directory.index = index;
+    dir->value.directory.index_size = size;
+    return 0;
+}
+
+// enter the entry at position pos of dir, for which dir_reserve made room
+void index_add(super_block_t *handle, inode_t *dir, size_t pos){
+    index_slot_t *slot;
+    char *name;
+    size_t len, hash;
+
+    name = entry_name(handle, dir_entry(handle, dir, pos));
+    len = strlen(name);
+    hash = name_hash(name, len);
+    slot = index_slot(handle, dir, name, len, hash);
+    slot->hash = hash;
+    slot->pos = pos + 1;
+}
+
+// remove the entry at position pos of dir from the index
+void index_remove(super_block_t *handle, inode_t *dir, size_t pos){
+    index_slot_t *slots;
+    size_t mask, i, j, home;
+
+    slots = (index_slot_t *) offset_to_ptr(handle, dir->value.directory.index);
+    mask = dir->value.directory.index_size - 1;
+    i = (size_t) (index_find(handle, dir, pos) - slots);
+
+    // shift back the slots after i that their probe would no longer reach
+    for (j = (i + 1) & mask; slots[j].pos != 0; j = (j + 1) & mask){
+        home = slots[j].hash & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)){
+            slots[i] = slots[j];
+            i = j;
+        }
+    }
+    slots[i].pos = (size_t) 0;
+}
+
+// make room in dir and its index for num entries, -1 if out of memory
+int dir_reserve(super_block_t *handle, inode_t *dir, size_t num){
+    offset_t children;
+    size_t capacity, size;
+
+    capacity = dir->value.directory.capacity;
+    if (capacity < num){
+        if (capacity == (size_t) 0)
+            capacity = DIR_MIN_CAPACITY;
+        while (capacity < num)
+            capacity *= 2;
+        if (dir->value.directory.children == (offset_t) 0)
+            children = allocate_memory(handle, capacity * DIRENT_SIZE);
+        else
+            children = reallocate_memory(handle, dir->value.directory.children,
+                    capacity * DIRENT_SIZE);
+        if (children == (offset_t) 0)
+            return -1;
+        dir->value.directory.children = children;
+        dir->value.directory.capacity = capacity;
+    }
+
+    size = dir->value.directory.index_size;
+    if (size == (size_t) 0)
+        size = INDEX_MIN_SIZE;
+    while (num * 2 > size)
+        size *= 2;
+    if (size == dir->value.directory.index_size)
+        return 0;
+    return index_resize(handle, dir, size);
+}
+
+// add an entry for inode ino named name (len bytes) to dir, -1 if out of memory
+int dir_add(super_block_t *handle, inode_t *dir, const char *name, size_t len,
+        inode_num_t ino){
+    dirent_t *entry;
+    size_t pos;
+
+    pos = dir->value.directory.num_children;
+    if (dir_reserve(handle, dir, pos + 1) == -1)
+        return -1;
+    entry = dir_entry(handle, dir, pos);
+    if (set_entry_name(handle, entry, name, len) == -1)
+        return -1;
+    entry->ino = ino;
+    dir->value.directory.num_children++;
+    index_add(handle, dir, pos);
+    return 0;
+}
+
+/*
+ * remove the entry at position pos from dir: the last entry takes its
+ * place, the entries and the index shrink when they get sparse
+ */
+void dir_remove(super_block_t *handle, inode_t *dir, size_t pos){
+    offset_t children;
+    size_t last, num;
+
+    index_remove(handle, dir, pos);
+    free_entry_name(handle, dir_entry(handle, dir, pos));
+    last = dir->value.directory.num_children - 1;
+    if (pos != last){
+        index_find(handle, dir, last)->pos = pos + 1;
+        *dir_entry(handle, dir, pos) = *dir_entry(handle, dir, last);
+    }
+    num = --dir->value.directory.num_children;
+
+    if (num == (size_t) 0){
+        free_memory(handle, dir->value.directory.children);
+        dir->value.directory.children = (offset_t) 0;
+        dir->value.directory.capacity = (size_t) 0;
+        index_resize(handle, dir, (size_t) 0);
+        return;
+    }
+    if (num * 4 < dir->value.directory.capacity
+            && dir->value.directory.capacity > DIR_MIN_CAPACITY){
+        children = reallocate_memory(handle, dir->value.directory.children,
+                dir->value.directory.capacity / 2 * DIRENT_SIZE);
+        if (children != (offset_t) 0){
+            dir->value.directory.children = children;
+            dir->value.directory.capacity /= 2;
+        }
+    }
+    if (num * 8 < dir->value.directory.index_size
+            && dir->value.directory.index_size > INDEX_MIN_SIZE)
+        index_resize(handle, dir, dir->value.directory.index_size / 2);
+}
+
+void init_dir(inode_t *node){
+    node->type = DIRECTORY;
+    node->value.directory.num_children = (size_t) 0;
+    node->value.directory.capacity = (size_t) 0;
+    node->value.directory.children = (offset_t) 0;
+    node->value.directory.index_size = (size_t) 0;
+    node->value.directory.index = (offset_t) 0;
+}
+
+// inode at the path of the characters path to end, NULL if there is none
+inode_t *walk_path(super_block_t *handle, const char *path, const char *end){
+    inode_t *node;
+    dirent_t *entry;
+    const char *name, *stop;
 
-    if (handle->root_dir == (offset_t) 0){
+    if (handle->root_dir == (inode_num_t) 0){
         struct timespec ts;
         clock_gettime(CLOCK_REALTIME, &ts);
-        handle->root_dir = allocate_memory(handle, INODE_SIZE);
-        inode_t *root = (inode_t *) offset_to_ptr(handle, handle->root_dir);
-        root->name[0] = '/';
-        root->name[1] = '\0';
-        root->type = DIRECTORY;
+        handle->root_dir = allocate_inode(handle);
+        if (handle->root_dir == (inode_num_t) 0)
+            return NULL;
+        inode_t *root = get_inode(handle, handle->root_dir);
+        init_dir(root);
         root->mod_time = ts;
         root->acc_time = ts;
+    }
+
+    node = get_inode(handle, handle->root_dir);
+
+    // one index lookup per component, which is not copied
+    for (name = path; name < end; name = stop){
+        while (name < end && *name == '/')
+            name++;
+        if (name == end)
+            break;
+
+        for (stop = name; stop < end && *stop != '/'; stop++);
+
+        if (node->type != DIRECTORY)
+            return NULL;
+        entry = dir_lookup(handle, node, name, (size_t) (stop - name));
+        if (entry == NULL) // path not found
+            return NULL;
+        node = get_inode(handle, entry->ino);
+    }
+
+    return node;
+}
 
-        root->value.directory.num_children = (size_t) 0;
-        root->value.directory.children = (offset_t) 0;
+inode_t *get_path(super_block_t *handle, const char *path){
+    return walk_path(handle, path, path + strlen(path));
+}
+
+// directory holding the last component of path, NULL if there is none
+inode_t *get_parent(super_block_t *handle, const char *path){
+    inode_t *node;
+
+    node = walk_path(handle, path, strrchr(path, '/'));
+    if (node == NULL || node->type != DIRECTORY)
+        return NULL;
+    return node;
+}
+
+// 1 if node is one of the directories leading to the last component of path
+int on_path(super_block_t *handle, inode_t *node, const char *path){
+    const char *end;
+
+    for (end = strchr(path + 1, '/'); end != NULL; end = strchr(end + 1, '/')){
+        if (walk_path(handle, path, end) == node)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * create a file or directory at path; the inode is left for the caller
+ * to fill in. NULL and *errnoptr set on failure
+ */
+inode_t *create_node(super_block_t *handle, int *errnoptr, const char *path,
+        inode_type_t type){
+    inode_t *dir, *node;
+    inode_num_t ino;
+    char *name;
+    struct timespec ts;
+
+    name = strrchr(path, '/') + 1;
+    if (strlen(name) >= MAX_FILE_NAME){
+        *errnoptr = ENAMETOOLONG;
+        return NULL;
     }
 
-    node = (inode_t *) offset_to_ptr(handle, handle->root_dir);
+    dir = get_parent(handle, path);
+    if (dir == NULL){
+        *errnoptr = ENOENT;
+        return NULL;
+    }
 
-    if (strcmp("/\0", path) == 0){ // path is root directory
-        return node;
+    if (dir_lookup(handle, dir, name, strlen(name)) != NULL){
+        *errnoptr = EEXIST;
+        return NULL;
     }
-    
-    __path = (char *) malloc((strlen(path)+1) * sizeof(char));
-    if (__path == NULL){
+
+    ino = allocate_inode(handle);
+    if (ino == (inode_num_t) 0){
+        *errnoptr = ENOMEM;
+        return NULL;
+    }
+    if (dir_add(handle, dir, name, strlen(name), ino) == -1){
+        free_inode(handle, ino);
+        *errnoptr = ENOMEM;
         return NULL;
     }
-    strcpy(__path, path);
-    name = __path + 1;
-    index = strchr(name, '/');
 
-    while (strlen(name) != 0){
-        child = NULL; 
+    clock_gettime(CLOCK_REALTIME, &ts);
+    node = get_inode(handle, ino);
+    node->type = type;
+    node->mod_time = ts;
+    node->acc_time = ts;
+    return node;
+}
+
+void init_file(inode_t *node){
+    node->value.file.size = (size_t) 0;
+    node->value.file.num_extents = (size_t) 0;
+    node->value.file.max_extents = (size_t) 0;
+    node->value.file.extents = (offset_t) 0;
+}
 
-        if (index != NULL)
-            size = (size_t) (((void *) index) - ((void *) name));
+static inline extent_t *file_extent(super_block_t *handle, inode_t *node, size_t i){
+    return ((extent_t *) offset_to_ptr(handle, node->value.file.extents)) + i;
+}
 
+// index of the extent of node holding byte pos, which must be below the size
+size_t find_extent(super_block_t *handle, inode_t *node, size_t pos){
+    extent_t *extents;
+    size_t low, high, mid;
+
+    extents = file_extent(handle, node, 0);
+    low = 0;
+    high = node->value.file.num_extents - 1;
+    while (low < high){
+        mid = low + (high - low + 1) / 2;
+        if (extents[mid].start <= pos)
+            low = mid;
         else
-            size = (size_t) strlen(name);
+            high = mid - 1;
+    }
+    return low;
+}
 
-        strncpy(file_name, name, size);
-        file_name[size] = '\0';
+// copy len bytes to the end of extent, from buf or zeros if buf is NULL
+static inline void extent_fill(super_block_t *handle, extent_t *extent,
+        const char *buf, size_t len){
+    void *dest = offset_to_ptr(handle, extent->data + extent->length);
 
-        for (size_t i = 0; i < node->value.directory.num_children; i++){
-            child = (inode_t *) offset_to_ptr(handle,
-                        (node->value.directory.children + i*INODE_SIZE));
+    if (buf == NULL)
+        memset(dest, '\0', len);
+    else
+        memcpy(dest, buf, len);
+    extent->length += len;
+}
 
-            if (strcmp(child->name, file_name) == 0){
-                node = child;
-                break;
-            }
+/*
+ * append len bytes to node, copied from buf or zeros if buf is NULL.
+ * They go into the slack of the tail extent, which is first grown in 
+ * place if the memory after it is free, and only the rest goes into a 
+ * new extent. Both reserve about as much again as the file has, up to
+ * FILE_MAX_SLACK, so that a file written by many small appends takes
+ * amortized O(1) per append and consists of few large extents.
+ * -1 if out of memory
+ */
+int file_append(super_block_t *handle, inode_t *node, const char *buf, size_t len){
+    extent_t *extent;
+    offset_t extents, data;
+    size_t max_extents, slack, capacity, n;
+
+    if (len == (size_t) 0)
+        return 0;
+
+    slack = node->value.file.size;
+    if (slack > FILE_MAX_SLACK)
+        slack = FILE_MAX_SLACK;
+
+    if (node->value.file.num_extents > (size_t) 0){
+        extent = file_extent(handle, node, node->value.file.num_extents - 1);
+        if (extent->capacity - extent->length < len){
+            capacity = extent->length + len;
+            if (grow_memory(handle, extent->data, capacity + slack) == 0)
+                extent->capacity = capacity + slack;
+            else if (grow_memory(handle, extent->data, capacity) == 0)
+                extent->capacity = capacity;
         }
-        
-        memset(file_name, 0, size);
-        if (node != child) { // path not found
-            free(__path);
-            return NULL;
+
+        n = extent->capacity - extent->length;
+        if (n > len)
+            n = len;
+        extent_fill(handle, extent, buf, n);
+        node->value.file.size += n;
+        if (buf != NULL)
+            buf += n;
+        len -= n;
+        if (len == (size_t) 0)
+            return 0;
+    }
+
+    if (node->value.file.num_extents == node->value.file.max_extents){
+        max_extents = node->value.file.max_extents * 2;
+        if (max_extents == (size_t) 0){
+            max_extents = FILE_MIN_EXTENTS;
+            extents = allocate_memory(handle, max_extents * EXTENT_SIZE);
         }
+        else
+            extents = reallocate_memory(handle, node->value.file.extents,
+                    max_extents * EXTENT_SIZE);
+        if (extents == (offset_t) 0)
+            return -1;
+        node->value.file.extents = extents;
+        node->value.file.max_extents = max_extents;
+    }
 
-        if (index == NULL) {
-            break;
+    // a file written at once gets no slack
+    capacity = len + slack;
+    data = allocate_memory(handle, capacity);
+    if (data == (offset_t) 0){
+        capacity = len;
+        data = allocate_memory(handle, capacity);
+        if (data == (offset_t) 0)
+            return -1;
+    }
+
+    extent = file_extent(handle, node, node->value.file.num_extents++);
+    extent->start = node->value.file.size;
+    extent->length = (size_t) 0;
+    extent->capacity = capacity;
+    extent->data = data;
+    extent_fill(handle, extent, buf, len);
+    node->value.file.size += len;
+    return 0;
+}
+
+// drop the bytes of node from size on
+void file_shrink(super_block_t *handle, inode_t *node, size_t size){
+    extent_t *extent;
+    size_t i;
+
+    if (size >= node->value.file.size)
+        return;
+
+    i = size == (size_t) 0 ? (size_t) 0 : find_extent(handle, node, size - 1) + 1;
+    if (i > 0){
+        extent = file_extent(handle, node, i - 1);
+        if (extent->start + extent->length > size){ // its end goes back in place
+            extent->length = size - extent->start;
+            extent->capacity = extent->length;
+            shrink_memory(handle, extent->data, extent->capacity);
         }
+    }
+    for (size_t j = i; j < node->value.file.num_extents; j++)
+        free_memory(handle, file_extent(handle, node, j)->data);
+    node->value.file.num_extents = i;
+    node->value.file.size = size;
 
-        name = index + 1;
-        index = strchr(name, '/');
+    if (i == (size_t) 0 && node->value.file.extents != (offset_t) 0){
+        free_memory(handle, node->value.file.extents);
+        node->value.file.extents = (offset_t) 0;
+        node->value.file.max_extents = (size_t) 0;
     }
-    
-    free(__path);
-    return node;
 }
 
 size_t max_size(super_block_t *handle){
@@ -687,8 +1309,8 @@ int __myfs_readdir_implem(void *fsptr, size_t fssize, int *errnoptr,
                           const char *path, char ***namesptr) {
 
     super_block_t *handle;
-    inode_t *node, *child;
-    char **names;
+    inode_t *node;
+    char **names, *name;
     size_t size;
 
     handle = get_handle(fsptr, fssize);
@@ -704,6 +1326,11 @@ int __myfs_readdir_implem(void *fsptr, size_t fssize, int *errnoptr,
         return -1;
     }
 
+    if (node->type != DIRECTORY){
+        *errnoptr = ENOTDIR;
+        return -1;
+    }
+
     size = node->value.directory.num_children;
     if (size == (size_t) 0){
         return 0;
@@ -716,11 +1343,17 @@ int __myfs_readdir_implem(void *fsptr, size_t fssize, int *errnoptr,
     }
     
     for (size_t i = 0; i < size; i++){
-        child = ((inode_t *) offset_to_ptr(handle,
-                    (node->value.directory.children + i*INODE_SIZE)));
+        name = entry_name(handle, dir_entry(handle, node, i));
 
-        names[i] = (char *) calloc(strlen(child->name), sizeof(char));
-        strcpy(names[i], child->name);
+        names[i] = (char *) calloc(strlen(name) + 1, sizeof(char));
+        if (names[i] == NULL){
+            while (i > 0)
+                free(names[--i]);
+            free(names);
+            *errnoptr = ENOMEM;
+            return -1;
+        }
+        strcpy(names[i], name);
     }
 
     *namesptr = names;
@@ -748,12 +1381,8 @@ int __myfs_mknod_implem(void *fsptr, size_t fssize, int *errnoptr,
                         const char *path) {
 
     super_block_t *handle;
-    inode_t *node, *child;
-    char *file_name, *dir_path;
-    size_t dir_len, num_children;
-    struct timespec ts;
+    inode_t *child;
 
-    clock_gettime(CLOCK_REALTIME, &ts);
     //printf("MKNOD %s\n", path);
 
     handle = get_handle(fsptr, fssize);
@@ -762,66 +1391,12 @@ int __myfs_mknod_implem(void *fsptr, size_t fssize, int *errnoptr,
         return -1;
     }
 
-    if (INODE_SIZE > max_size(handle)){
-        *errnoptr = ENOMEM;
-        return -1;
-    }
-
-    file_name = strrchr(path, '/') + 1;
-    dir_len = strlen(path) - strlen(file_name);
-    if (strlen(file_name) >= MAX_FILE_NAME){
-        *errnoptr = ENAMETOOLONG;
-        return -1;
-    }
-    
-    dir_path = (char *) malloc((dir_len+1) * sizeof(char));
-    if (dir_path == NULL){
-        *errnoptr = ENOMEM;
-        return -1;
-    }
-
-    strncpy(dir_path, path, dir_len);
-    dir_path[dir_len] = '\0';
-    
-    node = get_path(handle, dir_path);
-    if (node == NULL){
-        free(dir_path);
-        *errnoptr = ENOENT;
+    child = create_node(handle, errnoptr, path, REG_FILE);
+    if (child == NULL)
         return -1;
-    }
-
-    node->value.directory.num_children++;
-    num_children = node->value.directory.num_children;
-
-    if (num_children == 1) {
-       node->value.directory.children = allocate_memory(handle, INODE_SIZE);
-        if (node->value.directory.children == (offset_t) 0){
-            *errnoptr = ENOMEM;
-            return -1;
-        }
-    }
-
-    else{
-       node->value.directory.children = reallocate_memory(handle,
-                node->value.directory.children, num_children * INODE_SIZE);
-        if (node->value.directory.children == (offset_t) 0){
-            *errnoptr = ENOMEM;
-            return -1;
-        }
-    }
-
-    child = (inode_t *) offset_to_ptr(handle, (node->value.directory.children 
-                + (num_children-1) * INODE_SIZE)); 
 
-    strcpy(child->name, file_name);
-    //printf("Child name %s\n", child->name);
-    child->type = REG_FILE;
-    child->mod_time = ts;
-    child->acc_time = ts;
-    child->value.file.size = (size_t) 0;
-    child->value.file.first_block = (offset_t) 0;
+    init_file(child);
 
-    free(dir_path);
     return 0;
 }
 
@@ -841,10 +1416,10 @@ int __myfs_unlink_implem(void *fsptr, size_t fssize, int *errnoptr,
                         const char *path) {
 
     super_block_t *handle;
-    inode_t *file_node, *dir_node, *node;
-    char *file_name, *dir_path;
-    size_t dir_len;
-    file_block_t *prev, *file_block;
+    inode_t *dir_node, *node;
+    dirent_t *entry;
+    inode_num_t ino;
+    char *file_name;
 
     handle = get_handle(fsptr, fssize);
     if (handle == NULL){
@@ -854,81 +1429,30 @@ int __myfs_unlink_implem(void *fsptr, size_t fssize, int *errnoptr,
 
     //printf("UNLINK %s\n", path);
 
-    file_node = get_path(handle, path);
-    if (file_node == NULL){
-        *errnoptr = ENOENT;
-        return -1;
-    }
-
-    if (file_node->type == DIRECTORY){
-        *errnoptr = EISDIR;
-        return -1;
-    }
-
     file_name = strrchr(path, '/') + 1;
-    dir_len = strlen(path) - strlen(file_name);
-
-    dir_path = (char *) malloc((dir_len+1) * sizeof(char));
-    if (dir_path == NULL){
-        *errnoptr = ENOMEM;
-        return -1;
-    }
-    strncpy(dir_path, path, dir_len);
-    dir_path[dir_len] = '\0';
-    
-    dir_node = get_path(handle, dir_path);
+    dir_node = get_parent(handle, path);
     if (dir_node == NULL){
-        free(dir_path);
         *errnoptr = ENOENT;
         return -1;
     }
 
-    for (size_t i = 0; i < dir_node->value.directory.num_children; i++){
-       node = (inode_t *) offset_to_ptr(handle,
-               dir_node->value.directory.children + i * INODE_SIZE);
-
-        if (strcmp(node->name, file_name) == 0){
-            break;
-        }
-    }
-
-    for (file_block = (file_block_t *) offset_to_ptr(handle,
-                node->value.file.first_block), prev = NULL; file_block != NULL;
-            prev = file_block, file_block = (file_block_t *) offset_to_ptr(handle,
-                file_block->nxt_file_block)){
-        
-        //free_memory(handle, file_block->data);
-        if (file_block->data != (offset_t) 0)
-            file_block->data = reallocate_memory(handle,
-                    file_block->data, (size_t) 0);
-
-        if (prev != NULL){
-            //free_memory(handle, ptr_to_offset((void *) prev, handle));
-            prev = (file_block_t *) reallocate_memory(handle,
-                    ptr_to_offset((void *) prev, handle), (size_t) 0);
-        } 
-    }
-
-    if (prev != NULL){
-        //free_memory(handle, ptr_to_offset((void *) prev, handle));
-        prev = (file_block_t *) reallocate_memory(handle,
-                ptr_to_offset((void *) prev, handle), (size_t) 0);
+    entry = dir_lookup(handle, dir_node, file_name, strlen(file_name));
+    if (entry == NULL){
+        *errnoptr = ENOENT;
+        return -1;
     }
 
-    node->value.file.size = (size_t) 0;
-
-    if (dir_node->value.directory.num_children > 1) {
-        memcpy((void *) node, offset_to_ptr(handle, (dir_node->value.directory.children 
-                + (dir_node->value.directory.num_children - 1) * INODE_SIZE)),
-            INODE_SIZE);
+    ino = entry->ino;
+    node = get_inode(handle, ino);
+    if (node->type == DIRECTORY){
+        *errnoptr = EISDIR;
+        return -1;
     }
 
-    dir_node->value.directory.num_children--;
-    dir_node->value.directory.children = reallocate_memory(handle,
-            dir_node->value.directory.children, (dir_node->value.directory.num_children
-                * INODE_SIZE));
+    file_shrink(handle, node, (size_t) 0);
 
-    free(dir_path);
+    dir_remove(handle, dir_node, entry_pos(handle, dir_node, entry));
+    free_inode(handle, ino);
     return 0;
 }
 
@@ -951,9 +1475,10 @@ int __myfs_rmdir_implem(void *fsptr, size_t fssize, int *errnoptr,
                         const char *path) {
 
     super_block_t *handle;
-    inode_t *file_node, *dir_node, *node;
-    char *dir_name, *dir_path;
-    size_t dir_len;
+    inode_t *file_node, *dir_node;
+    dirent_t *entry;
+    inode_num_t ino;
+    char *dir_name;
 
     handle = get_handle(fsptr, fssize);
     if (handle == NULL){
@@ -963,57 +1488,33 @@ int __myfs_rmdir_implem(void *fsptr, size_t fssize, int *errnoptr,
 
    // printf("RMDIR %s\n", path);
 
-    file_node = get_path(handle, path);
-    if (file_node == NULL){
+    dir_name = strrchr(path, '/') + 1;
+    dir_node = get_parent(handle, path);
+    if (dir_node == NULL){
         *errnoptr = ENOENT;
         return -1;
     }
 
-    if (file_node->value.directory.num_children != 0){
-        *errnoptr = ENOTEMPTY;
-        return -1;
-    }
-
-    dir_name = strrchr(path, '/') + 1;
-    dir_len = strlen(path) - strlen(dir_name);
-
-    dir_path = (char *) malloc((dir_len+1) * sizeof(char));
-    if (dir_path == NULL){
-        *errnoptr = ENOMEM;
-        return -1;
-    }
-    strncpy(dir_path, path, dir_len);
-    dir_path[dir_len] = '\0';
-    
-    dir_node = get_path(handle, dir_path);
-    if (dir_node == NULL){
-        free(dir_path);
+    entry = dir_lookup(handle, dir_node, dir_name, strlen(dir_name));
+    if (entry == NULL){
         *errnoptr = ENOENT;
         return -1;
     }
 
-
-    for (size_t i = 0; i < dir_node->value.directory.num_children; i++){
-        node = (inode_t *) offset_to_ptr(handle,
-               dir_node->value.directory.children + i * INODE_SIZE);
-
-        if (strcmp(node->name, dir_name) == 0){
-            break;
-        }
+    ino = entry->ino;
+    file_node = get_inode(handle, ino);
+    if (file_node->type != DIRECTORY){
+        *errnoptr = ENOTDIR;
+        return -1;
     }
 
-    if (dir_node->value.directory.num_children > 1) {
-        memcpy((void *) node, offset_to_ptr(handle, (dir_node->value.directory.children 
-                + (dir_node->value.directory.num_children - 1) * INODE_SIZE)),
-            INODE_SIZE);
+    if (file_node->value.directory.num_children != 0){
+        *errnoptr = ENOTEMPTY;
+        return -1;
     }
 
-    dir_node->value.directory.num_children--;
-    dir_node->value.directory.children = reallocate_memory(handle,
-            dir_node->value.directory.children, (dir_node->value.directory.num_children
-                * INODE_SIZE));
-
-    free(dir_path);
+    dir_remove(handle, dir_node, entry_pos(handle, dir_node, entry));
+    free_inode(handle, ino);
     return 0;
 }
 
@@ -1033,12 +1534,8 @@ int __myfs_mkdir_implem(void *fsptr, size_t fssize, int *errnoptr,
                         const char *path) {
 
     super_block_t *handle;
-    inode_t *node, *child, *dir_node;
-    char *dir_name, *dir_path;
-    size_t dir_len, num_children;
-    struct timespec ts;
+    inode_t *child;
 
-    clock_gettime(CLOCK_REALTIME, &ts);
     //printf("MKDIR %s\n", path);
 
     handle = get_handle(fsptr, fssize);
@@ -1047,70 +1544,12 @@ int __myfs_mkdir_implem(void *fsptr, size_t fssize, int *errnoptr,
         return -1;
     }
 
-    if (INODE_SIZE > max_size(handle)){
-        *errnoptr = ENOMEM;
-        return -1;
-    }
-
-    dir_node = get_path(fsptr, path);
-    if (dir_node != NULL){
-        *errnoptr = EEXIST;
-        return -1;
-    }
-
-    dir_name = strrchr(path, '/') + 1;
-    dir_len = strlen(path) - strlen(dir_name);
-    if (strlen(dir_name) >= MAX_FILE_NAME){
-        *errnoptr = ENAMETOOLONG;
-        return -1;
-    }
-
-    dir_path = malloc((dir_len+1) * sizeof(char));
-    if (dir_path == NULL){
-        *errnoptr = ENOMEM;
+    child = create_node(handle, errnoptr, path, DIRECTORY);
+    if (child == NULL)
         return -1;
-    }
-    strncpy(dir_path, path, dir_len);
-    dir_path[dir_len] = '\0';
-    
-    node = get_path(handle, dir_path);
-    if (node == NULL){
-        free(dir_path);
-        *errnoptr = ENOENT;
-        return -1;
-    }
-
-    node->value.directory.num_children++;
-    num_children = node->value.directory.num_children;
-
-    if (num_children == 1) {
-       node->value.directory.children = allocate_memory(handle, INODE_SIZE);
-        if (node->value.directory.children == (offset_t) 0){
-            *errnoptr = ENOMEM;
-            return -1;
-        }
-    }
 
-    else {
-       node->value.directory.children = reallocate_memory(handle,
-                node->value.directory.children, num_children * INODE_SIZE);
-        if (node->value.directory.children == (offset_t) 0){
-            *errnoptr = ENOMEM;
-            return -1;
-        }
-    }
-
-    child = (inode_t *) offset_to_ptr(handle, (node->value.directory.children 
-                + (num_children-1) * INODE_SIZE)); 
-
-    strcpy(child->name, dir_name);
-    child->type = DIRECTORY;
-    child->mod_time = ts;
-    child->acc_time = ts;
-    child->value.directory.num_children = (size_t) 0;
-    child->value.directory.children = (offset_t) 0;
+    init_dir(child);
 
-    free(dir_path);
     return 0;
 }
 
@@ -1134,9 +1573,11 @@ int __myfs_rename_implem(void *fsptr, size_t fssize, int *errnoptr,
                          const char *from, const char *to) {
 
     super_block_t *handle;
-    inode_t *from_file, *from_dir, *to_dir;
-    char *from_file_name, *to_file_name, *from_dir_name, *to_dir_name;
-    size_t from_dir_len, to_dir_len;
+    inode_t *from_file, *to_file, *from_dir, *to_dir;
+    dirent_t *from_entry, *to_entry, entry;
+    char *from_file_name, *to_file_name;
+    inode_num_t ino;
+    size_t pos;
     
     //printf("RENAME %s to %s\n", from, to);
     if (strcmp(from , to) == 0)
@@ -1148,97 +1589,86 @@ int __myfs_rename_implem(void *fsptr, size_t fssize, int *errnoptr,
         return -1;
     }
 
-    from_file = get_path(handle, from);
-    if (from_file == NULL){
-        *errnoptr = ENOENT;
-        return -1;
-    }
-
     to_file_name = strrchr(to, '/') + 1;
-    to_dir_len = strlen(to) - strlen(to_file_name);
     from_file_name = strrchr(from, '/') + 1;
-    from_dir_len = strlen(from) - strlen(from_file_name);
 
     if (strlen(to_file_name) >= MAX_FILE_NAME){
         *errnoptr = ENAMETOOLONG;
         return -1;
     }
 
-    to_dir_name = (char *) malloc((to_dir_len + 1) * sizeof(char));
-    from_dir_name = (char *) malloc((from_dir_len+1) * sizeof(char));
-    if (from_dir_name == NULL || to_dir_name == NULL){
-        *errnoptr = ENOMEM;
+    from_dir = get_parent(handle, from);
+    to_dir = get_parent(handle, to);
+    if (from_dir == NULL || to_dir == NULL){
+        *errnoptr = ENOENT;
         return -1;
     }
 
-    strncpy(from_dir_name, from, from_dir_len);
-    from_dir_name[from_dir_len] = '\0';
-
-    strncpy(to_dir_name, to, to_dir_len);
-    to_dir_name[to_dir_len] = '\0';
-    
-    from_dir = get_path(handle, from_dir_name);
-    if (from_dir == NULL){
-        free(from_dir_name);
-        free(to_dir_name);
+    from_entry = dir_lookup(handle, from_dir, from_file_name, strlen(from_file_name));
+    if (from_entry == NULL){
         *errnoptr = ENOENT;
         return -1;
     }
+    from_file = get_inode(handle, from_entry->ino);
 
-    to_dir = get_path(handle, to_dir_name);
-    if (to_dir == NULL){
-        free(from_dir_name);
-        free(to_dir_name);
-        *errnoptr = ENOENT;
+    // a directory cannot become a subdirectory of itself
+    if (from_file->type == DIRECTORY && on_path(handle, from_file, to)){
+        *errnoptr = EINVAL;
         return -1;
     }
 
-    strcpy(from_file->name, to_file_name);
+    // an existing target is replaced, which keeps the names unique
+    to_entry = dir_lookup(handle, to_dir, to_file_name, strlen(to_file_name));
+    if (to_entry == from_entry)
+        return 0;
+    if (to_entry != NULL){
+        to_file = get_inode(handle, to_entry->ino);
+        if (to_file->type == DIRECTORY && from_file->type != DIRECTORY){
+            *errnoptr = EISDIR;
+            return -1;
+        }
+        if (to_file->type != DIRECTORY && from_file->type == DIRECTORY){
+            *errnoptr = ENOTDIR;
+            return -1;
+        }
+        if (to_file->type == DIRECTORY && to_file->value.directory.num_children != 0){
+            *errnoptr = ENOTEMPTY;
+            return -1;
+        }
 
-    if (strcmp(from_dir_name, to_dir_name) == 0) {
-        free(from_dir_name);
-        free(to_dir_name);
+        // the entry of the target takes the inode, which needs no memory,
+        // so the target is only released once nothing can fail any more
+        ino = to_entry->ino;
+        to_entry->ino = from_entry->ino;
+        dir_remove(handle, from_dir, entry_pos(handle, from_dir, from_entry));
+        if (to_file->type == REG_FILE)
+            file_shrink(handle, to_file, (size_t) 0);
+        free_inode(handle, ino);
         return 0;
     }
 
-    to_dir->value.directory.num_children++;
-    if (to_dir->value.directory.children == (offset_t) 0){
-        to_dir->value.directory.children = allocate_memory(handle,
-                (to_dir->value.directory.num_children * INODE_SIZE));
+    if (from_dir == to_dir) {
+        // same directory: only the name of the entry changes
+        entry.ino = from_entry->ino;
+        if (set_entry_name(handle, &entry, to_file_name, strlen(to_file_name)) == -1){
+            *errnoptr = ENOMEM;
+            return -1;
+        }
+        pos = entry_pos(handle, from_dir, from_entry);
+        index_remove(handle, from_dir, pos);
+        free_entry_name(handle, from_entry);
+        *from_entry = entry;
+        index_add(handle, from_dir, pos);
+        return 0;
     }
 
-    else{
-        to_dir->value.directory.children = reallocate_memory(handle, 
-            to_dir->value.directory.children, (to_dir->value.directory.num_children
-                * INODE_SIZE));
-    }
-
-    // copy file from the "from path" to the "to path"
-    memmove(offset_to_ptr(handle, (to_dir->value.directory.children +
-                    (to_dir->value.directory.num_children - 1) * INODE_SIZE)),
-                (void *) from_file, INODE_SIZE);
-      
-    // delete the file from the "from path"
-    /*
-    if (__myfs_unlink_implem(fsptr, fssize, errnoptr, from) == -1)
+    // the entry moves from the "from path" to the "to path", the inode stays
+    if (dir_add(handle, to_dir, to_file_name, strlen(to_file_name), from_entry->ino) == -1){
+        *errnoptr = ENOMEM;
         return -1;
-        */
-
-    from_file->value.file.size = (size_t) 0;
-    if (from_dir->value.directory.num_children > 1){
-        memmove((void *) from_file, offset_to_ptr(handle,
-                    (from_dir->value.directory.children
-                    + (from_dir->value.directory.num_children - 1) * INODE_SIZE)),
-                 INODE_SIZE);
     }
-    
-    from_dir->value.directory.num_children--;
-    from_dir->value.directory.children = reallocate_memory(handle,
-            from_dir->value.directory.children, (from_dir->value.directory.num_children
-                * INODE_SIZE));
+    dir_remove(handle, from_dir, entry_pos(handle, from_dir, from_entry));
 
-    free(from_dir_name);
-    free(to_dir_name);
     return 0;
 }
 
@@ -1263,8 +1693,7 @@ int __myfs_truncate_implem(void *fsptr, size_t fssize, int *errnoptr,
 
     super_block_t *handle; 
     inode_t *node;
-    file_block_t *file_block, *prev;
-    off_t new_offset;
+    size_t size_before;
 
     //printf("TRUNCATE %s, offset %ld\n", path, offset);
 
@@ -1274,6 +1703,11 @@ int __myfs_truncate_implem(void *fsptr, size_t fssize, int *errnoptr,
         return -1;
     }
 
+    if (offset < (off_t) 0){
+        *errnoptr = EINVAL;
+        return -1;
+    }
+
     node = get_path(handle, path);
     if (node == NULL){
         *errnoptr = ENOENT;
@@ -1285,93 +1719,18 @@ int __myfs_truncate_implem(void *fsptr, size_t fssize, int *errnoptr,
         return -1;
     }
     
-    if (node->value.file.size == (size_t) 0){
-        if ((offset+FILE_BLOCK_SIZE) > (off_t) max_size(handle)){
-            *errnoptr = ENOMEM;
-            return -1;
-        }
-
-        node->value.file.first_block = allocate_memory(handle, FILE_BLOCK_SIZE);
-
-        if (node->value.file.first_block == (offset_t) 0){
-            *errnoptr = ENOMEM;
-            return -1;
-        }
-
-        file_block = (file_block_t *) offset_to_ptr(handle,
-                node->value.file.first_block);
-        node->value.file.size = offset;
-    }
-
-    else if (offset > node->value.file.size){
-        if ((offset+FILE_BLOCK_SIZE) > (off_t) max_size(handle)){
-            *errnoptr = ENOMEM;
-            return -1;
-        }
-        for (file_block = (file_block_t *) offset_to_ptr(handle,
-                   node->value.file.first_block), prev = NULL; file_block != NULL;
-                prev = file_block, file_block = (file_block_t *) offset_to_ptr(handle,
-                    file_block->nxt_file_block));
-        
-        prev->nxt_file_block = allocate_memory(handle, FILE_BLOCK_SIZE);
-        if (prev->nxt_file_block == (offset_t) 0){
-            *errnoptr = ENOMEM;
-            return -1;
-        }
-
-        file_block = (file_block_t *) offset_to_ptr(handle, prev->nxt_file_block);
-        node->value.file.size = offset;
-    } 
-
-    else{
-        node->value.file.size = offset;
-        new_offset = offset; 
-        for (file_block = (file_block_t *) offset_to_ptr(handle,
-                   node->value.file.first_block); file_block != NULL;
-                   file_block = (file_block_t *) offset_to_ptr(handle,
-                   file_block->nxt_file_block)){
-
-            if (new_offset > file_block->block_size)
-                new_offset -= file_block->block_size;
-
-            else
-                break;
-        }
-
-        if (file_block == NULL){
-            //printf("This shouldn't happen\n");
-            return -1;
-        } 
-        
-        file_block->data = reallocate_memory(handle, file_block->data, new_offset);
-        file_block->block_size = new_offset;
-        prev = NULL;
-        file_block = (file_block_t*) offset_to_ptr(handle, file_block->nxt_file_block);
-        while (file_block != NULL){
-            if (prev != NULL){
-                prev = (file_block_t *) reallocate_memory(handle, ptr_to_offset((void *)
-                            prev, handle), (size_t) 0);
-            }
-
-            free_memory(handle, file_block->data);
-            prev = file_block;
-            file_block = (file_block_t*) offset_to_ptr(handle,
-                    file_block->nxt_file_block);
-        }
-            if (prev != NULL){
-                free_memory(handle, ptr_to_offset((void *) prev, handle));
-            }
+    if ((size_t) offset <= node->value.file.size){
+        file_shrink(handle, node, (size_t) offset);
         return 0;
     }
 
-    file_block->nxt_file_block = (offset_t) 0;
-    file_block->data = allocate_memory(handle, offset);
-    if (file_block->data == (offset_t) 0){
+    // the file grows by zeros, all of them or none
+    size_before = node->value.file.size;
+    if (file_append(handle, node, NULL, (size_t) offset - size_before) == -1){
+        file_shrink(handle, node, size_before);
         *errnoptr = ENOMEM;
         return -1;
     }
-    file_block->block_size = offset;
-    memset(offset_to_ptr(handle, file_block->data), '\0', offset);
 
     return 0;
 }
@@ -1444,9 +1803,8 @@ int __myfs_read_implem(void *fsptr, size_t fssize, int *errnoptr,
 
     super_block_t *handle; 
     inode_t *node;
-    file_block_t *file_block;
-    size_t new_size;
-    off_t new_offset;
+    extent_t *extent;
+    size_t pos, len;
     int num_bytes = 0;
 
     //printf("Read %s, size %ld, offset %ld\n", path, size, offset);
@@ -1468,47 +1826,30 @@ int __myfs_read_implem(void *fsptr, size_t fssize, int *errnoptr,
         return -1;
     }
 
-    if ((size_t) offset > node->value.file.size){
-        return 0;
+    if (offset < (off_t) 0){
+        *errnoptr = EINVAL;
+        return -1;
     }
 
-    new_size = size;
-    new_offset = offset;
-    for (file_block = (file_block_t *) offset_to_ptr(handle,
-                node->value.file.first_block);
-            file_block != NULL;
-            file_block = (file_block_t *) offset_to_ptr(handle,
-                file_block->nxt_file_block)){
-
-        if (new_offset > file_block->block_size){
-            new_offset -= file_block->block_size;
-        }
-        else
-            break;
+    pos = (size_t) offset;
+    if (pos >= node->value.file.size){
+        return 0;
     }
 
-    while (file_block != NULL){
-        if (((size_t) new_offset + new_size) < file_block->block_size){
-            memcpy(buf+num_bytes, offset_to_ptr(handle, ((size_t) new_offset
-                            + file_block->data)), new_size);
-            num_bytes += (int) new_size;
-            break;
-        }
-
-        else{
-            new_size -= (file_block->block_size - new_offset);     
-            memcpy(buf+num_bytes, offset_to_ptr(handle, ((size_t) new_offset
-                            + file_block->data)), 
-                        (file_block->block_size - new_offset));
-
-            num_bytes += (int) (file_block->block_size - new_offset);
-        }
-
-        if (new_offset != (off_t) 0)
-            new_offset = 0;
-
-        file_block = (file_block_t *) offset_to_ptr(handle, file_block->nxt_file_block);
+    if (size > node->value.file.size - pos)
+        size = node->value.file.size - pos;
 
+    // the first extent is found by binary search, the rest follow it
+    for (extent = file_extent(handle, node, find_extent(handle, node, pos));
+            size > (size_t) 0; extent++){
+        len = extent->start + extent->length - pos;
+        if (len > size)
+            len = size;
+        memcpy(buf + num_bytes, offset_to_ptr(handle, extent->data 
+                    + (pos - extent->start)), len);
+        num_bytes += (int) len;
+        pos += len;
+        size -= len;
     }
     return num_bytes;
 }
@@ -1532,8 +1873,8 @@ int __myfs_write_implem(void *fsptr, size_t fssize, int *errnoptr,
                         const char *path, const char *buf, size_t size, off_t offset) {
     super_block_t *handle; 
     inode_t *node;
-    file_block_t *file_block;
-    int num_bytes;
+    extent_t *extent;
+    size_t pos, len, done, size_before;
 
     //printf("Write %s, size %ld, offset %ld\n", path, size, offset);
 
@@ -1554,66 +1895,42 @@ int __myfs_write_implem(void *fsptr, size_t fssize, int *errnoptr,
         return -1;
     }
 
-    if (node->value.file.size == (size_t) 0){
-        node->value.file.first_block = allocate_memory(handle, FILE_BLOCK_SIZE);
-        
-        if (node->value.file.first_block == (size_t) 0){
-            *errnoptr = ENOMEM;
-            return -1;
-        }
+    if (offset < (off_t) 0){
+        *errnoptr = EINVAL;
+        return -1;
     }
 
-    if (offset > node->value.file.size)
+    if ((size_t) offset > node->value.file.size)
         return 0;
 
-    file_block = (file_block_t*) offset_to_ptr(handle, node->value.file.first_block);
-
-    if (node->value.file.size == (size_t) 0){
-        file_block->data = allocate_memory(handle, size);
-        
-        if (file_block->data == (size_t) 0){
-            *errnoptr = ENOMEM;
-            return -1;
+    // overwrite the bytes the file already has
+    pos = (size_t) offset;
+    done = (size_t) 0;
+    if (pos < node->value.file.size){
+        for (extent = file_extent(handle, node, find_extent(handle, node, pos));
+                done < size && pos < node->value.file.size; extent++){
+            len = extent->start + extent->length - pos;
+            if (len > size - done)
+                len = size - done;
+            memcpy(offset_to_ptr(handle, extent->data + (pos - extent->start)),
+                    buf + done, len);
+            done += len;
+            pos += len;
         }
-        file_block->block_size = size;
-        file_block->nxt_file_block = (offset_t) 0;
-        node->value.file.size = size;
     }
 
-    else if (((size_t) offset + size) > node->value.file.size){
-        for (file_block = (file_block_t*) offset_to_ptr(handle,
-                    node->value.file.first_block);
-                file_block->nxt_file_block != (offset_t) 0;
-                file_block = (file_block_t *) offset_to_ptr(handle,
-                    file_block->nxt_file_block));
-
-        file_block->nxt_file_block = allocate_memory(handle, FILE_BLOCK_SIZE);
-        
-        if (file_block->nxt_file_block == (size_t) 0){
+    // and append the rest, of which the slack of the tail may have taken a part
+    size_before = node->value.file.size;
+    if (file_append(handle, node, buf + done, size - done) == -1){
+        done += node->value.file.size - size_before;
+        if (done == (size_t) 0){
             *errnoptr = ENOMEM;
             return -1;
         }
-
-        file_block = (file_block_t *) offset_to_ptr(handle, 
-                file_block->nxt_file_block);
-
-        file_block->data = allocate_memory(handle, size);
-        
-        if (file_block->data == (size_t) 0){
-            *errnoptr = ENOMEM;
-            return -1;
-        }
-        file_block->nxt_file_block = (offset_t) 0;
-
-        file_block->block_size = size;
-        node->value.file.size += size;
+        return (int) done;
     }
 
-    num_bytes = (int) size;
-    memcpy(offset_to_ptr(handle, file_block->data),
-            buf, size);
-
-    return num_bytes;
+    return (int) size;
 }
 
 /* Implements an emulation of the utimensat system call on the filesystem 
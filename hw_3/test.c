@@ -0,0 +1,428 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+/*
+ * Tests of implementation.c without FUSE: the __myfs_*_implem functions
+ * are called on a memory region like the one myfs.c maps.
+ *
+ *   gcc -g -O0 -Wall test.c implementation.c -o test && ./test
+ */
+
+int __myfs_getattr_implem(void *, size_t, int *, uid_t, gid_t, const char *, struct stat *);
+int __myfs_readdir_implem(void *, size_t, int *, const char *, char ***);
+int __myfs_mknod_implem(void *, size_t, int *, const char *);
+int __myfs_unlink_implem(void *, size_t, int *, const char *);
+int __myfs_rmdir_implem(void *, size_t, int *, const char *);
+int __myfs_mkdir_implem(void *, size_t, int *, const char *);
+int __myfs_rename_implem(void *, size_t, int *, const char *, const char *);
+int __myfs_truncate_implem(void *, size_t, int *, const char *, off_t);
+int __myfs_read_implem(void *, size_t, int *, const char *, char *, size_t, off_t);
+int __myfs_write_implem(void *, size_t, int *, const char *, const char *, size_t, off_t);
+int __myfs_utimens_implem(void *, size_t, int *, const char *, const struct timespec [2]);
+int __myfs_statfs_implem(void *, size_t, int *, struct statvfs *);
+
+#define FS_SIZE ((size_t) 1 << 26) // 64 MB
+
+#define CHECK(cond) do { \
+        if (!(cond)){ \
+            printf("%s:%d: check failed: %s (errno %d)\n", __FILE__, __LINE__, \
+                    #cond, err); \
+            exit(1); \
+        } \
+    } while (0)
+
+static void *fs;
+static int err;
+
+static long file_size(const char *path){
+    struct stat st;
+
+    if (__myfs_getattr_implem(fs, FS_SIZE, &err, 0, 0, path, &st) == -1)
+        return -1;
+    return (long) st.st_size;
+}
+
+static unsigned long free_blocks(void){
+    struct statvfs st;
+
+    __myfs_statfs_implem(fs, FS_SIZE, &err, &st);
+    return (unsigned long) st.f_bfree;
+}
+
+// few bytes at a time into files whose extents lie next to small free blocks
+static void test_appends(void){
+    static char model[2][1 << 16], buf[1 << 16];
+    const char *paths[2] = { "/a", "/b" };
+    size_t size[2] = { 0, 0 };
+    unsigned long before;
+    size_t n;
+    int f;
+
+    CHECK(__myfs_mknod_implem(fs, FS_SIZE, &err, "/a") == 0);
+    CHECK(__myfs_mknod_implem(fs, FS_SIZE, &err, "/b") == 0);
+    before = free_blocks();
+
+    srand(1);
+    for (int i = 0; i < 20000; i++){
+        f = rand() % 2;
+        if (i % 97 == 0){
+            size[f] /= 2;
+            CHECK(__myfs_truncate_implem(fs, FS_SIZE, &err, paths[f], size[f]) == 0);
+            continue;
+        }
+        n = 1 + rand() % 24;
+        if (size[f] + n > sizeof(model[f]))
+            continue;
+        for (size_t j = 0; j < n; j++)
+            model[f][size[f] + j] = (char) rand();
+        CHECK(__myfs_write_implem(fs, FS_SIZE, &err, paths[f], model[f] + size[f],
+                    n, size[f]) == (int) n);
+        size[f] += n;
+    }
+
+    for (f = 0; f < 2; f++){
+        CHECK(file_size(paths[f]) == (long) size[f]);
+        CHECK(__myfs_read_implem(fs, FS_SIZE, &err, paths[f], buf, sizeof(buf), 0)
+                == (int) size[f]);
+        CHECK(memcmp(buf, model[f], size[f]) == 0);
+    }
+
+    // all memory of the files comes back, so the free list is intact
+    CHECK(__myfs_truncate_implem(fs, FS_SIZE, &err, "/a", 0) == 0);
+    CHECK(__myfs_truncate_implem(fs, FS_SIZE, &err, "/b", 0) == 0);
+    CHECK(free_blocks() == before);
+    CHECK(__myfs_unlink_implem(fs, FS_SIZE, &err, "/a") == 0);
+    CHECK(__myfs_unlink_implem(fs, FS_SIZE, &err, "/b") == 0);
+    printf("appends: ok\n");
+}
+
+// number of entries of the directory path, each name counted in seen[]
+static int list_dir(const char *path, int *seen, int n){
+    char **names;
+    int count;
+
+    count = __myfs_readdir_implem(fs, FS_SIZE, &err, path, &names);
+    CHECK(count >= 0);
+    for (int i = 0; i < count; i++){
+        int k = atoi(names[i] + 1);
+
+        CHECK(names[i][0] == 'f' && k >= 0 && k < n);
+        seen[k]++;
+        free(names[i]);
+    }
+    if (count > 0)
+        free(names);
+    return count;
+}
+
+// many entries in one directory: lookups, duplicates, removal, renames
+static void names_round(void){
+    static int seen[3000];
+    char path[64], buf[16];
+
+    memset(seen, 0, sizeof(seen));
+    CHECK(__myfs_mkdir_implem(fs, FS_SIZE, &err, "/d") == 0);
+    for (int i = 0; i < 3000; i++){
+        snprintf(path, sizeof(path), "/d/f%d", i);
+        CHECK(__myfs_mknod_implem(fs, FS_SIZE, &err, path) == 0);
+        CHECK(__myfs_write_implem(fs, FS_SIZE, &err, path, path, strlen(path), 0)
+                == (int) strlen(path));
+    }
+    CHECK(__myfs_mknod_implem(fs, FS_SIZE, &err, "/d/f1234") == -1 && err == EEXIST);
+    CHECK(__myfs_mkdir_implem(fs, FS_SIZE, &err, "/d/f0") == -1 && err == EEXIST);
+    CHECK(list_dir("/d", seen, 3000) == 3000);
+    for (int i = 0; i < 3000; i++)
+        CHECK(seen[i] == 1);
+
+    for (int i = 0; i < 3000; i += 3){
+        snprintf(path, sizeof(path), "/d/f%d", i);
+        CHECK(__myfs_unlink_implem(fs, FS_SIZE, &err, path) == 0);
+    }
+    for (int i = 0; i < 3000; i++){
+        snprintf(path, sizeof(path), "/d/f%d", i);
+        CHECK(file_size(path) == (i % 3 == 0 ? -1 : (long) strlen(path)));
+    }
+    CHECK(__myfs_unlink_implem(fs, FS_SIZE, &err, "/d/f0") == -1 && err == ENOENT);
+
+    // a rename onto an existing name replaces that file
+    CHECK(__myfs_rename_implem(fs, FS_SIZE, &err, "/d/f1", "/d/f2") == 0);
+    CHECK(file_size("/d/f1") == -1 && err == ENOENT);
+    CHECK(__myfs_read_implem(fs, FS_SIZE, &err, "/d/f2", buf, sizeof(buf), 0) == 5);
+    CHECK(memcmp(buf, "/d/f1", 5) == 0);
+    // and onto a free name adds it
+    CHECK(__myfs_rename_implem(fs, FS_SIZE, &err, "/d/f2", "/d/f0") == 0);
+    CHECK(__myfs_rename_implem(fs, FS_SIZE, &err, "/d/f4", "/d/f4") == 0);
+    memset(seen, 0, sizeof(seen));
+    CHECK(list_dir("/d", seen, 3000) == 2000 - 1);
+    CHECK(seen[0] == 1 && seen[1] == 0 && seen[2] == 0 && seen[4] == 1);
+
+    CHECK(__myfs_rmdir_implem(fs, FS_SIZE, &err, "/d") == -1 && err == ENOTEMPTY);
+    for (int i = 0; i < 3000; i++){
+        snprintf(path, sizeof(path), "/d/f%d", i);
+        if (file_size(path) != -1)
+            CHECK(__myfs_unlink_implem(fs, FS_SIZE, &err, path) == 0);
+    }
+    CHECK(list_dir("/d", seen, 3000) == 0);
+    CHECK(__myfs_rmdir_implem(fs, FS_SIZE, &err, "/d") == 0);
+    CHECK(file_size("/d") == -1 && err == ENOENT);
+}
+
+static void test_names(void){
+    unsigned long after_first;
+
+    names_round();
+    // the inode table keeps its chunks; all else must come back
+    after_first = free_blocks();
+    names_round();
+    CHECK(free_blocks() == after_first);
+    printf("names: ok\n");
+}
+
+static int same_time(struct timespec a, struct timespec b){
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+// moves keep the inode: contents, times and the children of directories
+static void test_moves(void){
+    const struct timespec ts[2] = {{100, 5}, {200, 7}};
+    const char *dirs[] = {"/a", "/a/b", "/a/b/c", "/x"};
+    struct stat st;
+    char buf[16], path[32];
+    unsigned long before;
+
+    for (int i = 0; i < 4; i++)
+        CHECK(__myfs_mkdir_implem(fs, FS_SIZE, &err, dirs[i]) == 0);
+    CHECK(__myfs_mknod_implem(fs, FS_SIZE, &err, "/a/b/c/f") == 0);
+    CHECK(__myfs_write_implem(fs, FS_SIZE, &err, "/a/b/c/f", "content", 7, 0) == 7);
+    CHECK(__myfs_utimens_implem(fs, FS_SIZE, &err, "/a/b/c/f", ts) == 0);
+    CHECK(__myfs_mknod_implem(fs, FS_SIZE, &err, "/a/b/g") == 0);
+
+    CHECK(__myfs_rename_implem(fs, FS_SIZE, &err, "/a/b", "/x/b") == 0);
+    CHECK(file_size("/a/b") == -1 && err == ENOENT);
+    CHECK(__myfs_getattr_implem(fs, FS_SIZE, &err, 0, 0, "/a", &st) == 0 && st.st_nlink == 2);
+    CHECK(__myfs_getattr_implem(fs, FS_SIZE, &err, 0, 0, "/x", &st) == 0 && st.st_nlink == 3);
+    CHECK(__myfs_getattr_implem(fs, FS_SIZE, &err, 0, 0, "/x/b", &st) == 0 && st.st_nlink == 4);
+    CHECK(file_size("/x/b/g") == 0);
+    CHECK(__myfs_getattr_implem(fs, FS_SIZE, &err, 0, 0, "/x/b/c/f", &st) == 0);
+    CHECK(same_time(st.st_atim, ts[0]) && same_time(st.st_mtim, ts[1]));
+    CHECK(__myfs_read_implem(fs, FS_SIZE, &err, "/x/b/c/f", buf, sizeof(buf), 0) == 7);
+    CHECK(memcmp(buf, "content", 7) == 0);
+
+    // a file back and forth between directories
+    before = free_blocks();
+    for (int i = 0; i < 500; i++){
+        CHECK(__myfs_rename_implem(fs, FS_SIZE, &err, "/x/b/c/f", "/a/f") == 0);
+        CHECK(__myfs_rename_implem(fs, FS_SIZE, &err, "/a/f", "/x/b/c/f") == 0);
+    }
+    CHECK(free_blocks() == before);
+    CHECK(__myfs_getattr_implem(fs, FS_SIZE, &err, 0, 0, "/x/b/c/f", &st) == 0);
+    CHECK(same_time(st.st_atim, ts[0]) && same_time(st.st_mtim, ts[1]) && st.st_size == 7);
+
+    // a directory cannot replace a file and the other way round
+    CHECK(__myfs_rename_implem(fs, FS_SIZE, &err, "/x/b/c", "/x/b/g") == -1 && err == ENOTDIR);
+    CHECK(__myfs_rename_implem(fs, FS_SIZE, &err, "/x/b/g", "/x/b/c") == -1 && err == EISDIR);
+    CHECK(__myfs_rename_implem(fs, FS_SIZE, &err, "/x/b/g", "/nowhere/g") == -1 && err == ENOENT);
+
+    // a directory cannot replace a full one or move below itself
+    CHECK(__myfs_rename_implem(fs, FS_SIZE, &err, "/a", "/x/b") == -1 && err == ENOTEMPTY);
+    CHECK(__myfs_rename_implem(fs, FS_SIZE, &err, "/x/b", "/x/b/n") == -1 && err == EINVAL);
+    CHECK(__myfs_rename_implem(fs, FS_SIZE, &err, "/x", "/x/b/c/x") == -1 && err == EINVAL);
+    CHECK(file_size("/x/b/c/f") == 7);
+
+    // a file replaces one in another directory
+    CHECK(__myfs_mknod_implem(fs, FS_SIZE, &err, "/a/h") == 0);
+    CHECK(__myfs_write_implem(fs, FS_SIZE, &err, "/a/h", "old", 3, 0) == 3);
+    CHECK(__myfs_rename_implem(fs, FS_SIZE, &err, "/x/b/g", "/a/h") == 0);
+    CHECK(file_size("/a/h") == 0 && file_size("/x/b/g") == -1);
+    CHECK(__myfs_rename_implem(fs, FS_SIZE, &err, "/a/h", "/x/b/g") == 0);
+
+    // inodes of removed files are reused
+    for (int i = 0; i < 200; i++){
+        snprintf(path, sizeof(path), "/a/t%d", i);
+        CHECK(__myfs_mknod_implem(fs, FS_SIZE, &err, path) == 0);
+    }
+    for (int i = 0; i < 200; i++){
+        snprintf(path, sizeof(path), "/a/t%d", i);
+        CHECK(__myfs_unlink_implem(fs, FS_SIZE, &err, path) == 0);
+    }
+    before = free_blocks();
+    for (int round = 0; round < 10; round++){
+        for (int i = 0; i < 200; i++){
+            snprintf(path, sizeof(path), "/a/t%d", i);
+            CHECK(__myfs_mknod_implem(fs, FS_SIZE, &err, path) == 0);
+        }
+        for (int i = 0; i < 200; i++){
+            snprintf(path, sizeof(path), "/a/t%d", i);
+            CHECK(__myfs_unlink_implem(fs, FS_SIZE, &err, path) == 0);
+        }
+    }
+    CHECK(free_blocks() == before);
+
+    CHECK(__myfs_unlink_implem(fs, FS_SIZE, &err, "/x/b/c/f") == 0);
+    CHECK(__myfs_unlink_implem(fs, FS_SIZE, &err, "/x/b/g") == 0);
+    CHECK(__myfs_rmdir_implem(fs, FS_SIZE, &err, "/x/b/c") == 0);
+    CHECK(__myfs_rmdir_implem(fs, FS_SIZE, &err, "/x/b") == 0);
+    CHECK(__myfs_rmdir_implem(fs, FS_SIZE, &err, "/x") == 0);
+    CHECK(__myfs_rmdir_implem(fs, FS_SIZE, &err, "/a") == 0);
+    printf("moves: ok\n");
+}
+
+// moves the filesystem to another address, as a new mount of the file would
+static void remount(void){
+    void *copy = malloc(FS_SIZE);
+
+    CHECK(copy != NULL);
+    memcpy(copy, fs, FS_SIZE);
+    memset(fs, 0xAB, FS_SIZE);
+    free(fs);
+    fs = copy;
+}
+
+// name of length len made of c, in path as "/n/<name>"
+static void long_name(char *path, size_t len, char c){
+    strcpy(path, "/n/");
+    memset(path + 3, c, len);
+    path[3 + len] = '\0';
+}
+
+// names of every length that fits, stored inline or apart, survive renames and a remount
+static void test_long_names(void){
+    static const size_t lens[] = {1, 22, 23, 24, 25, 100, 254, 255};
+    char path[300], other[300], **names;
+    unsigned long before;
+    int n;
+
+    CHECK(__myfs_mkdir_implem(fs, FS_SIZE, &err, "/n") == 0);
+    before = free_blocks();
+    for (int i = 0; i < 8; i++){
+        long_name(path, lens[i], 'a' + i);
+        CHECK(__myfs_mknod_implem(fs, FS_SIZE, &err, path) == 0);
+        CHECK(__myfs_write_implem(fs, FS_SIZE, &err, path, path, lens[i], 0) == (int) lens[i]);
+    }
+    long_name(path, 256, 'z');
+    CHECK(__myfs_mknod_implem(fs, FS_SIZE, &err, path) == -1 && err == ENAMETOOLONG);
+    CHECK(__myfs_mkdir_implem(fs, FS_SIZE, &err, path) == -1 && err == ENAMETOOLONG);
+    long_name(other, 23, 'b');
+    CHECK(__myfs_rename_implem(fs, FS_SIZE, &err, other, path) == -1 && err == ENAMETOOLONG);
+
+    // short names become long ones and the other way round
+    for (int i = 0; i < 8; i++){
+        long_name(path, lens[i], 'a' + i);
+        long_name(other, lens[7 - i], 'A' + i);
+        CHECK(__myfs_rename_implem(fs, FS_SIZE, &err, path, other) == 0);
+    }
+
+    remount();
+    n = __myfs_readdir_implem(fs, FS_SIZE, &err, "/n", &names);
+    CHECK(n == 8);
+    for (int i = 0; i < n; i++){
+        int k = names[i][0] - 'A';
+
+        CHECK(k >= 0 && k < 8 && strlen(names[i]) == lens[7 - k]);
+        free(names[i]);
+    }
+    free(names);
+    for (int i = 0; i < 8; i++){
+        long_name(path, lens[7 - i], 'A' + i);
+        CHECK(file_size(path) == (long) lens[i]);
+        CHECK(__myfs_unlink_implem(fs, FS_SIZE, &err, path) == 0);
+    }
+    // the names stored apart are freed with their entries
+    CHECK(free_blocks() == before);
+    CHECK(__myfs_rmdir_implem(fs, FS_SIZE, &err, "/n") == 0);
+    printf("long names: ok\n");
+}
+
+// random writes, reads and truncates of interleaved files against a model
+static void test_extents(void){
+    static char model[3][1 << 18], buf[1 << 18];
+    const char *paths[3] = { "/x", "/y", "/z" };
+    size_t size[3] = { 0, 0, 0 }, off, n;
+    unsigned long before, full;
+    int f, op;
+
+    before = free_blocks();
+    for (f = 0; f < 3; f++)
+        CHECK(__myfs_mknod_implem(fs, FS_SIZE, &err, paths[f]) == 0);
+
+    srand(49);
+    for (int i = 0; i < 20000; i++){
+        f = rand() % 3;
+        op = rand() % 10;
+        off = rand() % (sizeof(model[f]) / 2);
+        n = 1 + rand() % (op == 0 ? 40000 : 3000);
+        if (op < 5){
+            // a write that starts past the end writes nothing
+            if (off > size[f]){
+                CHECK(__myfs_write_implem(fs, FS_SIZE, &err, paths[f], buf, n, off) == 0);
+                off = rand() % (size[f] + 1);
+            }
+            if (off + n > sizeof(model[f]))
+                continue;
+            for (size_t j = 0; j < n; j++)
+                model[f][off + j] = (char) rand();
+            CHECK(__myfs_write_implem(fs, FS_SIZE, &err, paths[f], model[f] + off, n, off)
+                    == (int) n);
+            if (off + n > size[f])
+                size[f] = off + n;
+        } else if (op < 9){
+            int got = __myfs_read_implem(fs, FS_SIZE, &err, paths[f], buf, n, off);
+
+            CHECK(got == (int) (off >= size[f] ? 0 : (off + n > size[f] ? size[f] - off : n)));
+            CHECK(memcmp(buf, model[f] + off, got) == 0);
+        } else {
+            // a truncate past the end appends zeros
+            if (off > size[f])
+                memset(model[f] + size[f], 0, off - size[f]);
+            CHECK(__myfs_truncate_implem(fs, FS_SIZE, &err, paths[f], off) == 0);
+            size[f] = off;
+        }
+    }
+
+    remount();
+    for (f = 0; f < 3; f++){
+        CHECK(file_size(paths[f]) == (long) size[f]);
+        CHECK(__myfs_read_implem(fs, FS_SIZE, &err, paths[f], buf, sizeof(buf), 0)
+                == (int) size[f]);
+        CHECK(memcmp(buf, model[f], size[f]) == 0);
+        CHECK(__myfs_unlink_implem(fs, FS_SIZE, &err, paths[f]) == 0);
+    }
+    CHECK(free_blocks() == before);
+
+    // on a full filesystem, a truncate still gives back the end of the extent it cuts
+    CHECK(__myfs_mknod_implem(fs, FS_SIZE, &err, "/full") == 0);
+    off = 0;
+    for (n = sizeof(buf); n > 0; n /= 2){
+        while (__myfs_write_implem(fs, FS_SIZE, &err, "/full", buf, n, off) == (int) n)
+            off += n;
+    }
+    full = free_blocks();
+    off = file_size("/full") / 2;
+    CHECK(__myfs_truncate_implem(fs, FS_SIZE, &err, "/full", off) == 0);
+    CHECK(file_size("/full") == (long) off);
+    CHECK(free_blocks() > full + off / 2 / 1024);
+    CHECK(__myfs_unlink_implem(fs, FS_SIZE, &err, "/full") == 0);
+    CHECK(free_blocks() == before);
+    printf("extents: ok\n");
+}
+
+int main(int argc, char *argv[]){
+    fs = calloc(1, FS_SIZE);
+    if (fs == NULL)
+        return 1;
+
+    test_appends();
+    test_names();
+    test_moves();
+    test_long_names();
+    test_extents();
+
+    free(fs);
+    return 0;
+}